@@ -80,6 +80,22 @@ void set_page_dir(page_t pgdir)
 	asm volatile("movl %0, %%cr3" : : "a"(pgdir << ARCH_PAGE_SIZE_LOG2));
 }
 
+int enable_pse()
+{
+	uint32_t a, d, cr4;
+
+	/* Check CPUID for PSE support */
+	cpuid(1, &a, &d);
+	if (0 == (d & 0x8)) {
+		return 0;
+	}
+
+	asm volatile("movl %%cr4, %0" : "=r"(cr4));
+	asm volatile("movl %0, %%cr4" : : "r"(cr4 | 0x10));
+
+	return 1;
+}
+
 static int cli_level = 0;
 void sti()
 {
@@ -297,6 +313,8 @@ typedef void (*irq_func)();
 typedef struct {
 	void * stack;
 	jmp_buf state;
+	/* Interrupt handlers running on this thread's stack */
+	int isr_depth;
 } arch_context_t;
 
 #endif
@@ -417,11 +435,33 @@ static void unhandled_isr(uint32_t num, uint32_t * state)
 	kernel_printk("UNHANDLED ISR %d\n", num);
 }
 
+/*
+ * Handlers run on the interrupted thread's stack, so the handler depth
+ * is kept per thread. A handler that blocks only raises the count of
+ * the thread it interrupted.
+ */
 void i386_isr(uint32_t num, uint32_t * state)
 {
 	isr_t isr = itable[num] ? itable[num] : unhandled_isr;
+	thread_t * thread = arch_get_thread();
 
+	thread->context.isr_depth++;
 	isr(num, state);
+	thread->context.isr_depth--;
+}
+
+int arch_in_interrupt()
+{
+	return arch_get_thread()->context.isr_depth;
+}
+
+/*
+ * In an interrupt handler, or with interrupts disabled, as when holding
+ * a spin lock, so we can't take locks that may already be held
+ */
+int arch_in_atomic()
+{
+	return cli_level || arch_in_interrupt();
 }
 
 thread_t * arch_get_thread()
@@ -509,7 +549,8 @@ static int arch_is_text(void * p)
 
 void ** arch_thread_backtrace(int levels)
 {
-	void ** backtrace = malloc(sizeof(*backtrace)*levels+1);
+	/* Return addresses, not references */
+	void ** backtrace = malloc_noptrs(sizeof(*backtrace)*levels+1);
 	thread_t * thread = arch_get_thread();
 	setjmp(thread->context.state);
 	void * stacktop = (void**)((char*)thread->context.stack + ARCH_PAGE_SIZE);
@@ -575,6 +616,10 @@ void arch_spin_unlock(int * p)
 #define ARCH_PAGE_SIZE (1<<ARCH_PAGE_SIZE_LOG2)
 #define ARCH_PAGE_TABLE_SIZE_LOG2 20
 #define ARCH_PAGE_TABLE_SIZE (1<<ARCH_PAGE_TABLE_SIZE_LOG2)
+#define ARCH_LARGE_PAGE_SIZE_LOG2 22
+#define ARCH_LARGE_PAGE_SIZE (1<<ARCH_LARGE_PAGE_SIZE_LOG2)
+#define ARCH_CACHE_LINE_LOG2 6
+#define ARCH_CACHE_LINE (1<<ARCH_CACHE_LINE_LOG2)
 
 /*
  *
@@ -42,7 +42,6 @@ extern char _bootstrap_start[];
 extern char _bootstrap_end[];
 extern char _bootstrap_nextalloc[];
 static char * nextalloc = _bootstrap_nextalloc;
-static char * heapend;
 
 #define ALIGNMENT 16
 
@@ -65,7 +64,18 @@ static void bootstrap_finish()
 void * arch_heap_page()
 {
 	void * p = nextalloc;
+
+	if (heap) {
+		if (nextalloc + ARCH_PAGE_SIZE > (char*)vm_kas_bottom()) {
+			/* Heap has run into the rest of kernel VM */
+			return 0;
+		}
+
+		/* Grow the heap segment to cover the new page */
+		heap->size = nextalloc + ARCH_PAGE_SIZE - (char*)heap->base;
+	}
 	nextalloc += ARCH_PAGE_SIZE;
+
 	return p;
 }
 
@@ -84,6 +94,9 @@ void arch_init()
 	page_t pend;
 	int pcount = 0;
 
+	/* The page allocator uses spin locks, which enable interrupts */
+	i386_init();
+
 	for(i=0;;i++) {
 		multiboot_memory_map_t * mmap = multiboot_mmap(i);
 
@@ -104,9 +117,6 @@ void arch_init()
 		}
 	}
 
-	/* 64MB heap by default */
-	heapend = data_start + 0x4000000;
-
 	pstart = ((uint32_t)&_bootstrap_start)>>ARCH_PAGE_SIZE_LOG2;
 	pend = ((uint32_t)(nextalloc-koffset))>>ARCH_PAGE_SIZE_LOG2;
 	for(i=0;;i++) {
@@ -132,7 +142,6 @@ void arch_init()
 			break;
 		}
 	}
-	i386_init();
 	vmap_init();
 	bootstrap_finish();
 	vm_init();
@@ -140,7 +149,13 @@ void arch_init()
 	page_t data_page = ((uintptr_t)data_start - koffset) >> ARCH_PAGE_SIZE_LOG2;
 	map_putpp(kas, code_start, vm_segment_direct(code_start, data_start - code_start, SEGMENT_R | SEGMENT_X, code_page ));
 	map_putpp(kas, data_start, vm_segment_direct(data_start, nextalloc - data_start, SEGMENT_R | SEGMENT_W, data_page ));
-	map_putpp(kas, nextalloc, heap = vm_segment_anonymous(nextalloc, heapend - nextalloc, SEGMENT_R | SEGMENT_W ));
+
+	/*
+	 * The heap grows up on demand from here, while other kernel VM is
+	 * allocated down from the top.
+	 */
+	vm_kas_start(vmap_kernel_top());
+	map_putpp(kas, nextalloc, heap = vm_segment_anonymous(nextalloc, 0, SEGMENT_R | SEGMENT_W ));
 	pci_scan();
 
 #if 0
@@ -156,7 +171,6 @@ void arch_init()
 		}
 	}
 #endif
-	vm_kas_start(heapend);
 	kernel_printk("Bootstrap end - %p\n", nextalloc);
 }
 
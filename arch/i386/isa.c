@@ -247,8 +247,10 @@ void arch_idle()
 			}
 		}
 		thread_lock(arch_idle);
-		thread_gc();
+		thread_gc_idle();
 		thread_unlock(arch_idle);
+		page_zero_idle();
+		page_heap_trim();
 		thread_yield();
 	}
 	kernel_panic("idle finished");
@@ -17,6 +17,13 @@ static __attribute__((section(".aligned"))) pte_t pgktbl[1024];
 
 #define VMAP_PAGE(add) ((page_t)add-(_kernel_offset-_kernel_offset_bootstrap) >> ARCH_PAGE_SIZE_LOG2)
 
+/*
+ * Large (4MB) pages are page directory entries with the PS bit set
+ */
+#define VMAP_PDE_PS 0x80
+#define VMAP_LARGE_PAGES (ARCH_LARGE_PAGE_SIZE >> ARCH_PAGE_SIZE_LOG2)
+static int vmap_pse;
+
 /*
  * Page dirs are at the top of the address space
  */
@@ -77,11 +84,37 @@ void vmap_set_asid(asid vid)
 	set_page_dir(pageno);
 }
 
+static pte_t * vmap_get_pde(asid vid, void * vaddress)
+{
+	int i = (vmap_get_pgtable(vid)-pgtbls) >> ARCH_PAGE_TABLE_SIZE_LOG2;
+
+	return &pgdirs[i][(uint32_t)vaddress >> ARCH_LARGE_PAGE_SIZE_LOG2];
+}
+
+/*
+ * Get the pte for vaddress if it is within a large page, as if it
+ * were mapped with a small page.
+ */
+static pte_t vmap_get_large_pte(asid vid, void * vaddress)
+{
+	pte_t pde = *vmap_get_pde(vid, vaddress);
+
+	if ((pde & (VMAP_PDE_PS | 0x1)) == (VMAP_PDE_PS | 0x1)) {
+		return (pde & ~VMAP_PDE_PS) + ((uint32_t)vaddress & (ARCH_LARGE_PAGE_SIZE-1) & ~(ARCH_PAGE_SIZE-1));
+	}
+
+	return 0;
+}
+
 page_t vmap_get_page(asid vid, void * vaddress)
 {
 	page_t vpage = (uint32_t)vaddress >> ARCH_PAGE_SIZE_LOG2;
 	pte_t * pgtbl = vmap_get_pgtable(vid);
-	uint32_t pte = pgtbl[vpage];
+	uint32_t pte = vmap_get_large_pte(vid, vaddress);
+
+	if (0 == pte) {
+		pte = pgtbl[vpage];
+	}
 
 	if (pte & 0x1) {
 		return pte >> ARCH_PAGE_SIZE_LOG2;
@@ -93,6 +126,11 @@ static pte_t vmap_get_pte(asid vid, void * vaddress)
 {
 	page_t vpage = (uint32_t)vaddress >> ARCH_PAGE_SIZE_LOG2;
 	pte_t * pgtbl = vmap_get_pgtable(vid);
+	pte_t pte = vmap_get_large_pte(vid, vaddress);
+
+	if (pte) {
+		return pte;
+	}
 
 	if (0 == vmap_get_page(vid, pgtbls+vpage)) {
 		return 0;
@@ -101,19 +139,118 @@ static pte_t vmap_get_pte(asid vid, void * vaddress)
 	return pgtbl[vpage];
 }
 
-static void vmap_set_pte(asid vid, void * vaddress, pte_t pte)
+/*
+ * Temporary mapping window, just below the page tables. Used from under
+ * other spinlocks, so it is held with interrupts off from map to unmap
+ * and must not nest.
+ */
+static int window_lock[1];
+
+/*
+ * Top of general kernel VM, below the mapping window
+ */
+void * vmap_kernel_top()
+{
+	return (char*)pgtbls - ARCH_PAGE_SIZE;
+}
+
+static void vmap_pgtable_alloc(asid vid, void * vaddress);
+static void * vmap_window_map(page_t page)
+{
+	char * window = vmap_kernel_top();
+
+	/* Any page table allocation happens before the lock */
+	vmap_pgtable_alloc(0, window);
+	spin_lock(window_lock);
+	vmap_map(0, window, page, 1, 0);
+
+	return window;
+}
+
+static void vmap_window_unmap(void * window)
+{
+	vmap_unmap(0, window);
+	spin_unlock(window_lock);
+}
+
+/*
+ * Set the page directory entry for vaddress in vid, or in all address
+ * spaces for the kernel (vid 0), as kernel page tables are shared.
+ */
+static void vmap_set_pde(asid vid, void * vaddress, pte_t pde)
+{
+	page_t vpage = (uint32_t)vaddress >> ARCH_PAGE_SIZE_LOG2;
+	pte_t * pgtbl = pgtbls;
+
+	if (vid) {
+		pgtbl = vmap_get_pgtable(vid);
+		*vmap_get_pde(vid, vaddress) = pde;
+		invlpg(pgtbl+vpage);
+		invlpg(vaddress);
+		return;
+	}
+
+	for(int i=0; i<ASID_COUNT; i++, pgtbl += ARCH_PAGE_TABLE_SIZE) {
+		pgdirs[i][(uint32_t)vaddress >> ARCH_LARGE_PAGE_SIZE_LOG2] = pde;
+		invlpg(pgtbl+vpage);
+	}
+	invlpg(vaddress);
+}
+
+/*
+ * Replace a large page with an equivalent page table, so part of it
+ * can be remapped.
+ */
+static void vmap_split_large(asid vid, void * vaddress)
+{
+	pte_t pde = *vmap_get_pde(vid, vaddress);
+	page_t page = page_alloc_zeroed();
+
+	if (0 == page) {
+		KTHROW(OutOfMemoryException, "No page for page table");
+	}
+
+	/* Fill in the page table before it goes live */
+	pte_t * pgtbl = vmap_window_map(page);
+	for(int i=0; i<VMAP_LARGE_PAGES; i++) {
+		pgtbl[i] = (pde & ~VMAP_PDE_PS) + (i << ARCH_PAGE_SIZE_LOG2);
+	}
+	vmap_window_unmap(pgtbl);
+
+	vmap_set_pde(vid, vaddress, (page << ARCH_PAGE_SIZE_LOG2) | 0x3 | (pde & 0x4));
+}
+
+/*
+ * Make sure the page table covering vaddress is mapped
+ */
+static void vmap_pgtable_alloc(asid vid, void * vaddress)
 {
 	page_t vpage = (uint32_t)vaddress >> ARCH_PAGE_SIZE_LOG2;
-	pte_t * pgtbl = vmap_get_pgtable(vid);
 
 	if (0 == vmap_get_page(vid, pgtbls+vpage)) {
-		page_t page = page_alloc();
+		page_t page = page_alloc_zeroed();
 		pte_t * pgtbl = pgtbls;
 
+		if (0 == page) {
+			KTHROW(OutOfMemoryException, "No page for page table");
+		}
+
 		for(int i=0; i<ASID_COUNT; i++, pgtbl += ARCH_PAGE_TABLE_SIZE) {
 			vmap_map(0, pgtbl+vpage, page, 1, 0);
 		}
 	}
+}
+
+static void vmap_set_pte(asid vid, void * vaddress, pte_t pte)
+{
+	page_t vpage = (uint32_t)vaddress >> ARCH_PAGE_SIZE_LOG2;
+	pte_t * pgtbl = vmap_get_pgtable(vid);
+
+	if (*vmap_get_pde(vid, vaddress) & VMAP_PDE_PS) {
+		vmap_split_large(vid, vaddress);
+	}
+
+	vmap_pgtable_alloc(vid, vaddress);
 	pgtbl[vpage] = pte;
 	/* FIXME: Only need this if vid is current or kernel as */
 	invlpg(vaddress);
@@ -132,16 +269,65 @@ void vmap_map(asid vid, void * vaddress, page_t page, int rw, int user)
 	vmap_set_pte(vid, vaddress, pte);
 }
 
+/*
+ * Map a large page, if PSE is available and both vaddress and page are
+ * large page aligned. Returns 0 if the caller should use small pages.
+ *
+ * The kernel is linked at 0xf0100000, so the image mapping in vmap_init
+ * only gets large pages for whole 4MB of image and boot heap above
+ * 0xf0400000, which a kernel of the current size doesn't reach.
+ */
+int vmap_map_large(asid vid, void * vaddress, page_t page, int rw, int user)
+{
+	pte_t * pde = vmap_get_pde(vid, vaddress);
+	pte_t pte = page << ARCH_PAGE_SIZE_LOG2 | VMAP_PDE_PS | 0x1;
+
+	if (!vmap_pse || (((uint32_t)vaddress | pte) & (ARCH_LARGE_PAGE_SIZE-1) & ~0xfff)) {
+		return 0;
+	}
+	if ((*pde & 0x1) && 0 == (*pde & VMAP_PDE_PS)) {
+		/* Already have a page table here */
+		return 0;
+	}
+
+	if (rw) {
+		pte |= 0x2;
+	}
+	if (user) {
+		pte |= 0x4;
+	}
+	vmap_set_pde(vid, vaddress, pte);
+
+	return 1;
+}
+
 void vmap_mapn(asid vid, int n, void * vaddress, page_t page, int rw, int user)
 {
 	int i = 0;
 	char * vp = vaddress;
 
-	for(i=0; i<n; i++, vp += ARCH_PAGE_SIZE) {
-		vmap_map(vid, vp, page+i, rw, user);
+	while(i<n) {
+		if (n-i >= VMAP_LARGE_PAGES && vmap_map_large(vid, vp, page+i, rw, user)) {
+			i += VMAP_LARGE_PAGES;
+			vp += ARCH_LARGE_PAGE_SIZE;
+		} else {
+			vmap_map(vid, vp, page+i, rw, user);
+			i++;
+			vp += ARCH_PAGE_SIZE;
+		}
 	}
 }
 
+/*
+ * Zero a physical page, through the temporary mapping window
+ */
+void vmap_clear_page(page_t page)
+{
+	void * window = vmap_window_map(page);
+	memset(window, 0, ARCH_PAGE_SIZE);
+	vmap_window_unmap(window);
+}
+
 int vmap_ismapped(asid vid, void * vaddress)
 {
 	pte_t pte = vmap_get_pte(vid, vaddress);
@@ -163,6 +349,34 @@ int vmap_isuser(asid vid, void * vaddress)
 	return pte & 0x4;
 }
 
+/*
+ * Hardware dirty bit, used by the GC as its write barrier. Large pages
+ * can't be cleaned a page at a time, so are always dirty.
+ */
+int vmap_isdirty(asid vid, void * vaddress)
+{
+	if (vmap_get_large_pte(vid, vaddress)) {
+		return 1;
+	}
+
+	pte_t pte = vmap_get_pte(vid, vaddress);
+
+	return pte & 0x40;
+}
+
+void vmap_clean(asid vid, void * vaddress)
+{
+	if (vmap_get_large_pte(vid, vaddress)) {
+		return;
+	}
+
+	pte_t pte = vmap_get_pte(vid, vaddress);
+
+	if ((pte & 0x41) == 0x41) {
+		vmap_set_pte(vid, vaddress, pte & ~0x40);
+	}
+}
+
 void vmap_unmap(asid vid, void * vaddress)
 {
 	vmap_set_pte(vid, vaddress, 0);
@@ -226,12 +440,10 @@ void vmap_init()
 		pgdirs[i][(uint32_t)code_start >> (ARCH_PAGE_SIZE_LOG2+10)] = pde;
 	}
 	vmap_set_asid(0);
-	for(; p<data_start; p+=ARCH_PAGE_SIZE) {
-		vmap_map(0, p, (uint32_t)(p-offset) >> ARCH_PAGE_SIZE_LOG2, 0, 0);
-	}
-	for(; p<end; p+=ARCH_PAGE_SIZE) {
-		vmap_map(0, p, (uint32_t)(p-offset) >> ARCH_PAGE_SIZE_LOG2, 1, 0);
-	}
+	vmap_pse = enable_pse();
+	vmap_mapn(0, (data_start-p) >> ARCH_PAGE_SIZE_LOG2, p, (uint32_t)(p-offset) >> ARCH_PAGE_SIZE_LOG2, 0, 0);
+	p = data_start;
+	vmap_mapn(0, (end-p) >> ARCH_PAGE_SIZE_LOG2, p, (uint32_t)(p-offset) >> ARCH_PAGE_SIZE_LOG2, 1, 0);
 	vmap_test();
 }
 
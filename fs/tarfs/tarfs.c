@@ -167,7 +167,7 @@ static void tarfs_readblock( tarfs_t * fs, off_t offset, void * buf )
 static char * tarfs_fullname(tarfs_header_t * h)
 {
 	if (h->prefix[0]) {
-		char * fullname = malloc(256);
+		char * fullname = malloc_noptrs(256);
 		snprintf(fullname, 255, "%s/%s", h->prefix, h->name);
 		return fullname;
 	} else {
@@ -234,18 +234,21 @@ static void tarfs_regularfile( tarfs_t * fs, tarfs_header_t * h, off_t offset )
 	node->offset = offset;
 	node->size = tarfs_otoi(h->size, sizeof(h->size));
 	tarfs_add_node(fs, fullname, node);
+	free(fullname);
 }
 
 static void tarfs_directory( tarfs_t * fs, tarfs_header_t * h )
 {
 	char * fullname = tarfs_fullname(h);
 	kernel_printk("Directory: %s\n", fullname);
+	free(fullname);
 }
 
 static void tarfs_symlink( tarfs_t * fs, tarfs_header_t * h )
 {
 	char * fullname = tarfs_fullname(h);
 	kernel_printk("Symlink  : %s\n", fullname);
+	free(fullname);
 }
 
 static off_t tarfs_nextheader( tarfs_header_t * h, off_t offset )
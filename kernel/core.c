@@ -3,13 +3,72 @@
 
 #include "core.h"
 
+#if INTERFACE
+
+/*
+ * Largest buddy block is 2^PAGE_ORDER_MAX pages (4MB)
+ */
+#define PAGE_ORDER_MAX 10
+
+/*
+ * Physical memory zones. DMA is memory reachable by ISA DMA (<16MB)
+ */
+enum page_zone_e { PAGE_ZONE_DMA, PAGE_ZONE_NORMAL, PAGE_ZONES };
+
+typedef void (*page_reclaim_t)(int zone, int direct);
+
 /*
- * Page usage record
+ * Further mappings of a page, beyond the first in its usage record
  */
-struct page_usage {
+typedef struct page_rmap_s {
 	asid as;
-	void * rmap;
-};
+	void * p;
+	struct page_rmap_s * next;
+} page_rmap_t;
+
+/*
+ * Page usage record, one per page of RAM
+ */
+typedef struct page_usage_s {
+	/* Buddy order, if the page starts a free block */
+	uint8_t order;
+	uint8_t flags;
+	uint16_t age;
+
+	/* Number of mappings */
+	int ref;
+	union {
+		/* Free pages - buddy list links */
+		struct {
+			uint32_t next;
+			uint32_t prev;
+		} link;
+		/* In use pages - first mapping */
+		struct {
+			asid as;
+			void * p;
+		} map;
+	};
+	/* In use pages - other mappings */
+	page_rmap_t * rmap;
+} page_usage_t;
+
+#endif
+
+/*
+ * Physical pages are managed by a binary buddy allocator.
+ *
+ * Each free block of 2^order pages is naturally aligned in physical
+ * memory, and is on the free list for its order. The buddy of a block
+ * is the block with the order bit of the page number flipped.
+ *
+ * We can't store list links in the free pages themselves, as physical
+ * memory isn't mapped, so the links live in the per page usage records
+ * instead. usage[i].order is the order of the free block starting at
+ * page i, or PAGE_ORDER_USED if page i doesn't start a free block.
+ */
+#define PAGE_ORDER_USED 0xff
+#define PAGE_NONE 0xffffffff
 
 /*
  * Up to 32 maps
@@ -18,93 +77,810 @@ struct kernel_mmap {
 	page_t base;
 	int count;
 	int free;
-	uint32_t * available;
+	int zone;
+	uint32_t freelist[PAGE_ORDER_MAX+1];
+	page_usage_t * usage;
 };
 
 static int mmap_count = 0;
 static struct kernel_mmap mmap[32];
 
+/*
+ * Per zone free page counts and watermarks.
+ *
+ * Dropping below low wakes background reclaim, which runs until free
+ * is back above high. Normal allocations don't take a zone below min,
+ * instead reclaiming directly before dipping into the reserve.
+ *
+ * Free counts include the pages cached in the page magazine and the
+ * pre-zeroed pool, which are only ever Normal pages.
+ */
+#define PAGE_ZONE_DMA_LIMIT (0x1000000 >> ARCH_PAGE_SIZE_LOG2)
+
+typedef struct page_zone {
+	const char * name;
+	int total;
+	int free;
+	int min;
+	int low;
+	int high;
+} page_zone_t;
+
+static page_zone_t zones[PAGE_ZONES] = {
+	{ name: "DMA" },
+	{ name: "Normal" }
+};
+
 void page_add_range(page_t base, uint32_t count)
 {
-	size_t bitmapsize = (count+31)/32;
+	struct kernel_mmap * m = mmap + mmap_count;
+	page_zone_t * zone;
 	int i;
-	mmap[mmap_count].base = base;
-	mmap[mmap_count].count = count;
-	mmap[mmap_count].free = 0;
-	mmap[mmap_count].available = bootstrap_alloc(sizeof(mmap[mmap_count].available[0]) * bitmapsize);
-	for(i=0; i<bitmapsize; i++) {
-		mmap[mmap_count].available[i] = 0;
+
+	if (base < PAGE_ZONE_DMA_LIMIT && base + count > PAGE_ZONE_DMA_LIMIT) {
+		/* Split the range at the zone boundary */
+		page_add_range(base, PAGE_ZONE_DMA_LIMIT - base);
+		page_add_range(PAGE_ZONE_DMA_LIMIT, base + count - PAGE_ZONE_DMA_LIMIT);
+		return;
+	}
+
+	m->base = base;
+	m->count = count;
+	m->free = 0;
+	m->zone = (base < PAGE_ZONE_DMA_LIMIT) ? PAGE_ZONE_DMA : PAGE_ZONE_NORMAL;
+	zone = zones + m->zone;
+	zone->total += count;
+	zone->min = zone->total / 128;
+	zone->low = zone->min * 2;
+	zone->high = zone->min * 3;
+	m->usage = bootstrap_alloc(sizeof(m->usage[0]) * count);
+	for(i=0; i<=PAGE_ORDER_MAX; i++) {
+		m->freelist[i] = PAGE_NONE;
+	}
+	for(i=0; i<count; i++) {
+		m->usage[i].order = PAGE_ORDER_USED;
+		m->usage[i].flags = 0;
+		m->usage[i].age = 0;
+		m->usage[i].ref = 0;
+		m->usage[i].rmap = 0;
 	}
 	mmap_count++;
 }
 
-void page_free(page_t page)
+static struct kernel_mmap * page_get_mmap(page_t page)
 {
-	int i = 0;
-	for(; i<mmap_count; i++) {
-		int p = page - mmap[i].base;
-		if (p > 0 && p < mmap[i].count) {
-			/*
-			 * Page is in this memory range, mark it as free
-			 */
-			mmap[i].available[p/32] |= (0x80000000 >> p%32);
-			mmap[i].free++;
-			return;
+	for(int i=0; i<mmap_count; i++) {
+		if (page >= mmap[i].base && page - mmap[i].base < mmap[i].count) {
+			return mmap + i;
 		}
 	}
-	/* FIXME: Panic here */
+
+	return 0;
 }
 
-page_t page_alloc()
+/*
+ * Get the usage record for page, or 0 if page is not RAM
+ */
+page_usage_t * page_get_usage(page_t page)
+{
+	struct kernel_mmap * m = page_get_mmap(page);
+
+	return (m) ? m->usage + page - m->base : 0;
+}
+
+
+/*
+ * Advance a clock hand to the next page of RAM, wrapping around at the
+ * end of the last region. Any non-RAM page starts at the first region.
+ */
+page_t page_clock_next(page_t page)
+{
+	struct kernel_mmap * m = page_get_mmap(page);
+
+	if (m && page + 1 - m->base < m->count) {
+		return page + 1;
+	}
+
+	return mmap[(m) ? (m - mmap + 1) % mmap_count : 0].base;
+}
+
+static void page_list_add(struct kernel_mmap * m, uint32_t i, int order)
+{
+	uint32_t head = m->freelist[order];
+
+	m->usage[i].link.prev = PAGE_NONE;
+	m->usage[i].link.next = head;
+	if (PAGE_NONE != head) {
+		m->usage[head].link.prev = i;
+	}
+	m->freelist[order] = i;
+	m->usage[i].order = order;
+}
+
+static void page_list_remove(struct kernel_mmap * m, uint32_t i, int order)
+{
+	uint32_t next = m->usage[i].link.next;
+	uint32_t prev = m->usage[i].link.prev;
+
+	if (PAGE_NONE != prev) {
+		m->usage[prev].link.next = next;
+	} else {
+		m->freelist[order] = next;
+	}
+	if (PAGE_NONE != next) {
+		m->usage[next].link.prev = prev;
+	}
+	m->usage[i].order = PAGE_ORDER_USED;
+}
+
+static void page_buddy_free(page_t page, int order)
+{
+	struct kernel_mmap * m = page_get_mmap(page);
+
+	if (0 == page || 0 == m) {
+		/* Page 0 is our failure return, never hand it out */
+		/* FIXME: Panic here */
+		return;
+	}
+
+	m->free += 1 << order;
+	zones[m->zone].free += 1 << order;
+
+	/* Reset usage, in case the page was freed while still mapped */
+	for(int i=0; i < (1 << order); i++) {
+		page_usage_t * usage = m->usage + page - m->base + i;
+
+		usage->flags = 0;
+		usage->age = 0;
+		usage->ref = 0;
+		while(usage->rmap) {
+			page_rmap_t * rmap = usage->rmap;
+			usage->rmap = rmap->next;
+			page_rmap_free(rmap);
+		}
+	}
+
+	/*
+	 * Coalesce with our buddy for as long as it is free and of the same
+	 * order.
+	 */
+	while(order < PAGE_ORDER_MAX) {
+		page_t buddy = page ^ (1 << order);
+
+		if (buddy < m->base || buddy + (1 << order) > m->base + m->count) {
+			/* Buddy is not (entirely) within this range */
+			break;
+		}
+		if (m->usage[buddy - m->base].order != order) {
+			/* Buddy is not a free block of the same size */
+			break;
+		}
+
+		page_list_remove(m, buddy - m->base, order);
+		page &= ~(1 << order);
+		order++;
+	}
+
+	page_list_add(m, page - m->base, order);
+}
+
+static page_t page_buddy_alloc_zone(int zone, int order)
 {
 	int m = mmap_count - 1;
 
 	for(;m>=0; m--) {
-		if (mmap[m].free>0) {
-			int p;
-
-			for(p=0; p<mmap[m].count; p+=32) {
-				if (mmap[m].available[p/32]) {
-					uint32_t mask = 0x80000000;
-					for(; mask; mask >>= 1, p++) {
-						if (mmap[m].available[p/32] & mask) {
-							mmap[m].available[p/32] &= (~mask);
-							mmap[m].free--;
-							return mmap[m].base + p;
-						}
+		if (mmap[m].zone == zone && mmap[m].free >= (1 << order)) {
+			int o;
+
+			for(o=order; o<=PAGE_ORDER_MAX; o++) {
+				uint32_t i = mmap[m].freelist[o];
+
+				if (PAGE_NONE != i) {
+					page_list_remove(mmap+m, i, o);
+
+					/* Split the block, returning the upper halves */
+					while(o > order) {
+						o--;
+						page_list_add(mmap+m, i + (1 << o), o);
 					}
-					/* FIXME: panic */
+
+					mmap[m].free -= 1 << order;
+					zones[zone].free -= 1 << order;
+					return mmap[m].base + i;
 				}
 			}
-			/* FIXME: panic, we should have found a free page */
 		}
 	}
-	/* FIXME: Out of memory panic or exception */
+
 	return 0;
 }
 
+/*
+ * Allocate from zone, falling back to lower zones down to lowest.
+ * Unless reserve is set, zones are not taken below their min watermark.
+ */
+static page_t page_buddy_alloc(int zone, int lowest, int order, int reserve)
+{
+	for(int z=zone; z>=lowest; z--) {
+		if (reserve || zones[z].free - (1 << order) >= zones[z].min) {
+			page_t page = page_buddy_alloc_zone(z, order);
+			if (page) {
+				return page;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The buddy lists are global, and protected by page_lock.
+ */
+static int page_lock;
+
+static page_reclaim_t page_reclaim_hook;
+
+void page_set_reclaim(page_reclaim_t reclaim)
+{
+	page_reclaim_hook = reclaim;
+}
+
+/*
+ * Call the reclaim hook, either to wake background reclaim or, if
+ * direct is set, to reclaim what it can before returning.
+ */
+static void page_reclaim(int zone, int direct)
+{
+	static int reclaiming = 0;
+
+	if (page_reclaim_hook && 0 == reclaiming) {
+		reclaiming = 1;
+		page_reclaim_hook(zone, direct);
+		reclaiming = 0;
+	}
+}
+
+static void page_reclaim_check(int zone)
+{
+	for(int z=zone; z>=0; z--) {
+		if (zones[z].total && zones[z].free < zones[z].low) {
+			page_reclaim(z, 0);
+		}
+	}
+}
+
+int page_zone_shortfall(int zone)
+{
+	return zones[zone].high - zones[zone].free;
+}
+
+static int page_buddy_alloc_batch(int zone, int lowest, int order, int reserve, int n, page_t pages[])
+{
+	int i = 0;
+
+	SPIN_AUTOLOCK(&page_lock) {
+		for(; i<n && (pages[i] = page_buddy_alloc(zone, lowest, order, reserve)); i++) {
+		}
+	}
+
+	return i;
+}
+
+/*
+ * Zone the page magazine and zeroed pool cache pages from, Normal unless
+ * there's only DMA memory
+ */
+static int page_cache_zone()
+{
+	return (zones[PAGE_ZONE_NORMAL].total) ? PAGE_ZONE_NORMAL : PAGE_ZONE_DMA;
+}
+
+/*
+ * Count n pages going into (n > 0) or out of (n < 0) the page magazine
+ * or zeroed pool, which count as free
+ */
+static void page_cached(int n)
+{
+	SPIN_AUTOLOCK(&page_lock) {
+		zones[page_cache_zone()].free += n;
+	}
+}
+
+/*
+ * Allocate up to n blocks, reclaiming directly and using the reserve
+ * if we can't get them all above the min watermark.
+ */
+static int page_zone_alloc(int zone, int order, int n, page_t pages[])
+{
+	int i = page_buddy_alloc_batch(zone, PAGE_ZONE_DMA, order, 0, n, pages);
+
+	if (i<n) {
+		page_reclaim(zone, 1);
+		i += page_buddy_alloc_batch(zone, PAGE_ZONE_DMA, order, 1, n-i, pages+i);
+	}
+	page_reclaim_check(zone);
+
+	return i;
+}
+
+/*
+ * Free n pages from the page magazine to the buddy lists
+ */
+static void page_buddy_free_batch(int n, page_t pages[])
+{
+	SPIN_AUTOLOCK(&page_lock) {
+		/* Already counted as free */
+		zones[page_cache_zone()].free -= n;
+		for(int i=0; i<n; i++) {
+			page_buddy_free(pages[i], 0);
+		}
+	}
+}
+
+page_t page_alloc_zone(int zone, int order)
+{
+	page_t page = 0;
+
+	check_int_bounds(zone, PAGE_ZONE_DMA, PAGE_ZONES-1, "Page zone out of bounds");
+	check_int_bounds(order, 0, PAGE_ORDER_MAX, "Page order out of bounds");
+	page_zone_alloc(zone, order, 1, &page);
+
+	return page;
+}
+
+page_t page_alloc_order(int order)
+{
+	return page_alloc_zone(PAGE_ZONE_NORMAL, order);
+}
+
+void page_free_order(page_t page, int order)
+{
+	check_int_bounds(order, 0, PAGE_ORDER_MAX, "Page order out of bounds");
+
+	SPIN_AUTOLOCK(&page_lock) {
+		page_buddy_free(page, order);
+	}
+}
+
+/*
+ * Single pages are allocated and freed through a per-CPU magazine of
+ * free pages, which is refilled from and drained to the buddy lists in
+ * bulk, so the global page_lock is only taken once per batch. The
+ * magazine only holds pages of page_cache_zone, so DMA pages aren't
+ * handed out where they're not needed, unless there are only DMA pages.
+ */
+#define PAGE_MAGAZINE_SIZE 32
+
+typedef struct page_magazine {
+	int lock[1];
+	int count;
+	page_t pages[PAGE_MAGAZINE_SIZE];
+} page_magazine_t;
+
+static page_magazine_t magazines[1];
+
+static page_magazine_t * page_magazine()
+{
+	/* FIXME: Index by CPU once we have more than one */
+	return magazines;
+}
+
+int page_alloc_batch(int n, page_t pages[])
+{
+	page_magazine_t * mag = page_magazine();
+	int i = 0;
+
+	SPIN_AUTOLOCK(mag->lock) {
+		int refill = 0;
+
+		if (n > mag->count) {
+			/* Refill the magazine in one go, but not from the reserve */
+			int zone = page_cache_zone();
+			refill = page_buddy_alloc_batch(zone, zone, 0, 0, PAGE_MAGAZINE_SIZE - mag->count, mag->pages + mag->count);
+			mag->count += refill;
+		}
+		while(i<n && mag->count) {
+			pages[i++] = mag->pages[--mag->count];
+		}
+		page_cached(refill - i);
+	}
+
+	if (i<n) {
+		/* Bigger than the magazine or short of memory, get the rest directly */
+		i += page_zone_alloc(PAGE_ZONE_NORMAL, 0, n-i, pages+i);
+	} else {
+		page_reclaim_check(PAGE_ZONE_NORMAL);
+	}
+
+	return i;
+}
+
+void page_free_batch(int n, page_t pages[])
+{
+	page_magazine_t * mag = page_magazine();
+
+	SPIN_AUTOLOCK(mag->lock) {
+		for(int i=0; i<n; i++) {
+			if (0 == pages[i]) {
+				continue;
+			} else if (pages[i] < PAGE_ZONE_DMA_LIMIT && PAGE_ZONE_DMA != page_cache_zone()) {
+				/* Straight back to the DMA zone */
+				page_free_order(pages[i], 0);
+				continue;
+			}
+			if (PAGE_MAGAZINE_SIZE == mag->count) {
+				/* Drain the top half of the magazine in one go */
+				mag->count = PAGE_MAGAZINE_SIZE/2;
+				page_buddy_free_batch(PAGE_MAGAZINE_SIZE/2, mag->pages + mag->count);
+			}
+			mag->pages[mag->count++] = pages[i];
+			page_cached(1);
+		}
+	}
+}
+
+/*
+ * Pool of pre-zeroed pages, topped up by the idle thread, so zeroing
+ * is kept off the allocation and fault paths.
+ */
+#define PAGE_ZERO_POOL_SIZE 64
+#define PAGE_ZERO_BATCH 8
+
+static int page_zero_lock;
+static int page_zero_count;
+static page_t page_zero_pool[PAGE_ZERO_POOL_SIZE];
+
+static page_t page_zero_get()
+{
+	page_t page = 0;
+
+	SPIN_AUTOLOCK(&page_zero_lock) {
+		if (page_zero_count) {
+			page = page_zero_pool[--page_zero_count];
+		}
+	}
+	if (page) {
+		page_cached(-1);
+	}
+
+	return page;
+}
+
+page_t page_alloc()
+{
+	page_t page = 0;
+
+	if (0 == page_alloc_batch(1, &page)) {
+		/* Last resort, use a pre-zeroed page */
+		page = page_zero_get();
+	}
+
+	return page;
+}
+
+page_t page_alloc_zeroed()
+{
+	page_t page = page_zero_get();
+
+	if (0 == page) {
+		/* Pool is empty, zero a page ourselves */
+		page = page_alloc();
+		if (page) {
+			vmap_clear_page(page);
+		}
+	}
+
+	return page;
+}
+
+/*
+ * Take a page to zero while the cache zone is above low, counting it as
+ * still free
+ */
+static page_t page_zero_alloc()
+{
+	page_t page = 0;
+
+	SPIN_AUTOLOCK(&page_lock) {
+		int zone = page_cache_zone();
+
+		if (zones[zone].free > zones[zone].low) {
+			page = page_buddy_alloc(zone, zone, 0, 0);
+		}
+		if (page) {
+			zones[zone].free++;
+		}
+	}
+
+	return page;
+}
+
+/*
+ * Called from the idle loop, zero a batch of pages into the pool.
+ *
+ * Only pages of page_cache_zone are zeroed, and only while that zone is
+ * above its low watermark, without reclaiming or touching the reserve,
+ * so background zeroing never causes memory pressure.
+ */
+void page_zero_idle()
+{
+	for(int i=0; i<PAGE_ZERO_BATCH && page_zero_count < PAGE_ZERO_POOL_SIZE; i++) {
+		page_t page = page_zero_alloc();
+
+		if (0 == page) {
+			return;
+		}
+		vmap_clear_page(page);
+
+		SPIN_AUTOLOCK(&page_zero_lock) {
+			if (page_zero_count < PAGE_ZERO_POOL_SIZE) {
+				page_zero_pool[page_zero_count++] = page;
+				page = 0;
+			}
+		}
+
+		if (page) {
+			/* Pool filled up behind our back */
+			page_cached(-1);
+			page_free(page);
+		}
+	}
+}
+
+void page_free(page_t page)
+{
+	page_free_batch(1, &page);
+}
+
+void page_test()
+{
+	int startfree[PAGE_ZONES];
+	for(int z=0; z<PAGE_ZONES; z++) {
+		startfree[z] = zones[z].free;
+	}
+
+	page_t p1 = page_alloc_order(4);
+	page_t p2 = page_alloc_order(4);
+
+	/* Blocks are naturally aligned and disjoint */
+	assert(p1 && p2);
+	assert(0 == (p1 & 0xf));
+	assert(0 == (p2 & 0xf));
+	assert(p1 != p2);
+
+	/* Freed blocks coalesce back into larger blocks */
+	page_free_order(p1, 4);
+	page_free_order(p2, 4);
+	page_t p3 = page_alloc_order(5);
+	assert(p3);
+	page_free_order(p3, 5);
+
+	/* Adjacent order-0 pages coalesce into their order-1 block */
+	page_t pair = page_alloc_order(1);
+	assert(pair && 0 == (pair & 0x1));
+	page_free_order(pair, 0);
+	page_free_order(pair + 1, 0);
+	assert(pair == page_alloc_order(1));
+	page_free_order(pair, 1);
+
+	/* DMA pages are below 16MB */
+	page_t dma = page_alloc_zone(PAGE_ZONE_DMA, 0);
+	assert(dma && dma < PAGE_ZONE_DMA_LIMIT);
+	page_free(dma);
+
+	/* Everything freed back leaves the zones as they started */
+	for(int z=0; z<PAGE_ZONES; z++) {
+		assert(startfree[z] == zones[z].free);
+	}
+
+	/* DMA pages bypass the magazine, and cached pages still count as free */
+	int dmafree = zones[PAGE_ZONE_DMA].free;
+	int cachefree = zones[page_cache_zone()].free;
+	dma = page_alloc_zone(PAGE_ZONE_DMA, 0);
+	page_free_batch(1, &dma);
+	assert(dmafree == zones[PAGE_ZONE_DMA].free);
+
+	/* Batches bigger than the magazine */
+	page_t pages[PAGE_MAGAZINE_SIZE*2];
+	int n = page_alloc_batch(sizeof(pages)/sizeof(pages[0]), pages);
+	assert(n == sizeof(pages)/sizeof(pages[0]));
+	page_free_batch(n, pages);
+	assert(cachefree == zones[page_cache_zone()].free);
+
+	/* Freed heap runs are reused, cleared */
+	char * run = page_heap_alloc_pages(4);
+	run[ARCH_PAGE_SIZE] = 1;
+	page_heap_free_pages(run, 4);
+	assert(run == page_heap_alloc_pages(4));
+	assert(0 == run[ARCH_PAGE_SIZE]);
+	page_heap_free_pages(run, 4);
+}
+
+
+/*
+ * Freed heap pages are cached for reuse, but pages that stay unused for
+ * HEAP_CACHE_IDLE trim passes beyond the first heap_cache_retain are
+ * unmapped and returned to the page allocator. Their address space is
+ * kept in heap_unbacked for reuse.
+ *
+ * Cached pages are linked through their first word, and the second
+ * word records the trim pass in which they were freed.
+ *
+ * Multi-page runs are freed whole and cached the same way in heap_runs,
+ * with the third word recording the run length, so they can be reused
+ * by allocations of the same length instead of taking new address space.
+ * Trimmed runs keep their address space in heap_unbacked_runs.
+ */
+#define HEAP_CACHE_IDLE 16
+#define HEAP_UNBACKED_MAX 1024
+#define HEAP_UNBACKED_RUNS_MAX 256
 
 segment_t * heap;
 static int heap_cache_lock;
 static void ** heap_cache;
+static int heap_cache_retain = 64;
+static int heap_cache_gen;
+static void * heap_unbacked[HEAP_UNBACKED_MAX];
+static int heap_unbacked_count;
+static void ** heap_runs;
+static struct {
+	void * p;
+	int pages;
+} heap_unbacked_runs[HEAP_UNBACKED_RUNS_MAX];
+static int heap_unbacked_runs_count;
+
+void page_heap_retain(int pages)
+{
+	heap_cache_retain = pages;
+}
+
+/*
+ * Keep the address space of pages heap pages that couldn't be backed,
+ * for reuse once memory is available.
+ */
+static void page_heap_unbacked(void * p, int pages)
+{
+	SPIN_AUTOLOCK(&heap_cache_lock) {
+		if (1 == pages && heap_unbacked_count < HEAP_UNBACKED_MAX) {
+			heap_unbacked[heap_unbacked_count++] = p;
+		} else if (1 < pages && heap_unbacked_runs_count < HEAP_UNBACKED_RUNS_MAX) {
+			heap_unbacked_runs[heap_unbacked_runs_count].p = p;
+			heap_unbacked_runs[heap_unbacked_runs_count].pages = pages;
+			heap_unbacked_runs_count++;
+		}
+	}
+}
+
 void * page_heap_alloc()
 {
 	void * p = 0;
+	int recycled = 0;
+
 	SPIN_AUTOLOCK(&heap_cache_lock) {
 		if (heap_cache) {
 			p = heap_cache;
 			heap_cache = heap_cache[0];
+			recycled = 1;
+		} else if (heap_unbacked_count) {
+			p = heap_unbacked[--heap_unbacked_count];
 		} else {
 			p = arch_heap_page();
-			page_t page = page_alloc();
-			vmap_map(0, p, page, 1, 0);
+		}
+	}
 
-			if (heap) {
-				/* VM heap not configured yet, map manually! */
+	if (0 == p) {
+		KTHROW(OutOfMemoryException, "Kernel heap exhausted");
+	} else if (recycled) {
+		/* Clear the recycled page outside the lock */
+		memset(p, 0, ARCH_PAGE_SIZE);
+	} else {
+		page_t page = page_alloc_zeroed();
+
+		if (0 == page) {
+			page_heap_unbacked(p, 1);
+			KTHROW(OutOfMemoryException, "Kernel heap page unavailable");
+		}
+		vmap_map(0, p, page, 1, 0);
+
+		if (heap) {
+			/* VM heap not configured yet, map manually! */
+		}
+	}
+
+	return p;
+}
+
+/*
+ * Take a cached or unbacked run of pages, must be locked
+ */
+static void * page_heap_get_run(int pages, int * recycled)
+{
+	for(void *** pnext = &heap_runs; *pnext; pnext = (void***)*pnext) {
+		void ** pp = *pnext;
+
+		if (pages == (int)pp[2]) {
+			*pnext = pp[0];
+			*recycled = 1;
+			return pp;
+		}
+	}
+
+	for(int i=0; i<heap_unbacked_runs_count; i++) {
+		if (pages == heap_unbacked_runs[i].pages) {
+			void * p = heap_unbacked_runs[i].p;
+
+			heap_unbacked_runs[i] = heap_unbacked_runs[--heap_unbacked_runs_count];
+			return p;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Allocate pages contiguous heap pages, aligned to their total size,
+ * so the first page can be found from any address within them. pages
+ * must be a power of two.
+ *
+ * Runs freed with page_heap_free_pages are reused first, otherwise the
+ * run comes from new heap address space. Pages skipped to get the
+ * alignment are kept as unbacked pages.
+ */
+void * page_heap_alloc_pages(int pages)
+{
+	size_t size = pages << ARCH_PAGE_SIZE_LOG2;
+	char * p = 0;
+	int recycled = 0;
+	int full = 0;
+
+	check_int_is(pages & (pages-1), 0, "Heap page run not a power of two");
+	if (1 == pages) {
+		return page_heap_alloc();
+	}
+
+	SPIN_AUTOLOCK(&heap_cache_lock) {
+		p = page_heap_get_run(pages, &recycled);
+		if (p) {
+			/* Reused */
+		} else if (heap_unbacked_count + pages - 1 > HEAP_UNBACKED_MAX) {
+			/* No room to keep the alignment pages */
+			full = 1;
+		} else {
+			while((p = arch_heap_page()) && ((uintptr_t)p & (size-1))) {
+				heap_unbacked[heap_unbacked_count++] = p;
+			}
+			for(int i=1; p && i<pages; i++) {
+				if (0 == arch_heap_page()) {
+					p = 0;
+				}
 			}
 		}
+	}
 
-		memset(p, 0, ARCH_PAGE_SIZE);
+	if (full) {
+		KTHROW(OutOfMemoryException, "Kernel heap unbacked pages full");
+	} else if (0 == p) {
+		KTHROW(OutOfMemoryException, "Kernel heap exhausted");
+	} else if (recycled) {
+		memset(p, 0, size);
+	} else {
+		for(int i=0; i<pages; i++) {
+			page_t page = page_alloc_zeroed();
+
+			if (0 == page) {
+				/* Back out the pages mapped so far */
+				while(i--) {
+					char * vaddr = p + (i << ARCH_PAGE_SIZE_LOG2);
+
+					page = vmap_get_page(0, vaddr);
+					vmap_unmap(0, vaddr);
+					page_free(page);
+				}
+				page_heap_unbacked(p, pages);
+				KTHROW(OutOfMemoryException, "Kernel heap pages unavailable");
+			}
+			vmap_map(0, p + (i << ARCH_PAGE_SIZE_LOG2), page, 1, 0);
+		}
 	}
 
 	return p;
@@ -116,6 +892,125 @@ void page_heap_free(void * p)
 
 	SPIN_AUTOLOCK(&heap_cache_lock) {
 		pp[0] = heap_cache;
+		pp[1] = (void*)heap_cache_gen;
 		heap_cache = pp;
 	}
 }
+
+/*
+ * Free a run from page_heap_alloc_pages, keeping it whole for reuse
+ */
+void page_heap_free_pages(void * p, int pages)
+{
+	void ** pp = (void**)p;
+
+	if (1 == pages) {
+		page_heap_free(p);
+		return;
+	}
+
+	SPIN_AUTOLOCK(&heap_cache_lock) {
+		pp[0] = heap_runs;
+		pp[1] = (void*)heap_cache_gen;
+		pp[2] = (void*)pages;
+		heap_runs = pp;
+	}
+}
+
+/*
+ * Return the pages of long unused runs, must be locked
+ */
+static void page_heap_trim_runs(int retained)
+{
+	void *** pnext = &heap_runs;
+
+	while(*pnext) {
+		void ** pp = *pnext;
+		int idle = heap_cache_gen - (int)pp[1];
+		int pages = (int)pp[2];
+
+		if (retained < heap_cache_retain || idle < HEAP_CACHE_IDLE || HEAP_UNBACKED_RUNS_MAX == heap_unbacked_runs_count) {
+			pnext = (void***)pp;
+			retained += pages;
+		} else {
+			*pnext = pp[0];
+			for(int i=0; i<pages; i++) {
+				char * vaddr = (char*)pp + (i << ARCH_PAGE_SIZE_LOG2);
+				page_t page = vmap_get_page(0, vaddr);
+
+				vmap_unmap(0, vaddr);
+				page_free(page);
+			}
+			heap_unbacked_runs[heap_unbacked_runs_count].p = pp;
+			heap_unbacked_runs[heap_unbacked_runs_count].pages = pages;
+			heap_unbacked_runs_count++;
+		}
+	}
+}
+
+/*
+ * Called from the idle loop, return long unused heap pages.
+ */
+void page_heap_trim()
+{
+	SPIN_AUTOLOCK(&heap_cache_lock) {
+		void *** pnext = &heap_cache;
+		int retained = 0;
+
+		heap_cache_gen++;
+		while(*pnext) {
+			void ** pp = *pnext;
+			int idle = heap_cache_gen - (int)pp[1];
+
+			if (retained < heap_cache_retain || idle < HEAP_CACHE_IDLE || HEAP_UNBACKED_MAX == heap_unbacked_count) {
+				pnext = (void***)pp;
+				retained++;
+			} else {
+				page_t page = vmap_get_page(0, pp);
+
+				*pnext = pp[0];
+				vmap_unmap(0, pp);
+				page_free(page);
+				heap_unbacked[heap_unbacked_count++] = pp;
+			}
+		}
+		page_heap_trim_runs(retained);
+	}
+}
+
+/*
+ * Reverse map records, for the mappings of a page beyond the first.
+ * They're carved out of heap pages of their own, outside the GC, and
+ * hang off the page's usage record, so freeing the page frees them.
+ */
+static int page_rmap_lock;
+static page_rmap_t * page_rmap_spare;
+
+void page_rmap_free(page_rmap_t * rmap)
+{
+	SPIN_AUTOLOCK(&page_rmap_lock) {
+		rmap->next = page_rmap_spare;
+		page_rmap_spare = rmap;
+	}
+}
+
+page_rmap_t * page_rmap_alloc()
+{
+	page_rmap_t * rmap = 0;
+
+	SPIN_AUTOLOCK(&page_rmap_lock) {
+		rmap = page_rmap_spare;
+		if (rmap) {
+			page_rmap_spare = rmap->next;
+		}
+	}
+
+	if (0 == rmap) {
+		rmap = page_heap_alloc();
+		for(int i=1; i<ARCH_PAGE_SIZE/sizeof(*rmap); i++) {
+			page_rmap_free(rmap + i);
+		}
+	}
+
+	return rmap;
+}
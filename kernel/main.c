@@ -40,12 +40,15 @@ void kernel_main() {
 		page_cache_init();
 		process_init();
 		timer_init(arch_timer_ops());
+		vm_pageout_init();
+		thread_gc_init();
 
 		/* Create process 1 - init */
 		if (0 == process_fork()) {
 			run_init();
 		}
 
+		page_test();
 		dtor_test();
 		exception_test();
 		thread_test();
@@ -57,6 +60,9 @@ void kernel_main() {
 		vnode_t * root = tarfs_test();
 		vfs_test(root);
 		timer_test();
+		swap_test();
+		lz_test();
+		zswap_test();
 
 		char * p = arch_heap_page();
 		char c = *p;
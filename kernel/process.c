@@ -62,7 +62,8 @@ static void process_nextpid( process_t * process )
 	spin_unlock(lock);
 }
 
-slab_type_t processes[] = {SLAB_TYPE(sizeof(process_t), 0, 0)};
+slab_type_t processes[] = {SLAB_TYPE_LAYOUT(sizeof(process_t),
+	SLAB_PTR(process_t, parent) | SLAB_PTR(process_t, as) | SLAB_PTR(process_t, files) | SLAB_PTR(process_t, container), 0)};
 
 void process_init()
 {
@@ -0,0 +1,156 @@
+#include "swap.h"
+
+/*
+ * Swap space for anonymous memory.
+ *
+ * The swap device is divided into page sized slots, each with a
+ * reference count, as forked address spaces share swapped out pages.
+ * Swap entries are slot numbers plus one, so 0 is never a valid entry.
+ *
+ * Pages are mapped into a private window for the device I/O, which is
+ * serialized by swap_lock.
+ */
+static dev_t * swap_dev;
+static int swap_slots;
+static int swap_next;
+static uint8_t * swap_refs;
+static mutex_t swap_lock[1];
+static char * swap_window;
+
+static int swap_io(int entry, page_t page, int write)
+{
+	buf_op_t op = { write: write, p: swap_window, offset: (off_t)(entry-1) << ARCH_PAGE_SIZE_LOG2, size: ARCH_PAGE_SIZE };
+
+	vmap_map(0, swap_window, page, write == 0, 0);
+	dev_op_submit(swap_dev, &op);
+	dev_op_status status = dev_op_wait(&op);
+	vmap_unmap(0, swap_window);
+
+	return DEV_BUF_OP_COMPLETE == status;
+}
+
+static int swap_put(page_t page)
+{
+	int entry = 0;
+
+	mutex_lock(swap_lock);
+	for(int i=0; i<swap_slots; i++) {
+		int slot = (swap_next + i) % swap_slots;
+		if (0 == swap_refs[slot]) {
+			swap_refs[slot] = 1;
+			swap_next = slot + 1;
+			entry = slot + 1;
+			break;
+		}
+	}
+
+	if (entry && !swap_io(entry, page, 1)) {
+		/* Write failed, leave the page in memory */
+		swap_refs[entry-1] = 0;
+		entry = 0;
+	}
+	mutex_unlock(swap_lock);
+
+	return entry;
+}
+
+static void swap_release(int entry)
+{
+	check_int_bounds(entry, 1, swap_slots, "Invalid swap entry");
+	mutex_lock(swap_lock);
+	swap_refs[entry-1]--;
+	mutex_unlock(swap_lock);
+}
+
+static void swap_dup(int entry)
+{
+	check_int_bounds(entry, 1, swap_slots, "Invalid swap entry");
+	mutex_lock(swap_lock);
+	if (UINT8_MAX == swap_refs[entry-1]) {
+		mutex_unlock(swap_lock);
+		kernel_panic("Swap entry reference overflow: %d\n", entry);
+	}
+	swap_refs[entry-1]++;
+	mutex_unlock(swap_lock);
+}
+
+static void swap_get(int entry, page_t page)
+{
+	check_int_bounds(entry, 1, swap_slots, "Invalid swap entry");
+	mutex_lock(swap_lock);
+	if (!swap_io(entry, page, 0)) {
+		mutex_unlock(swap_lock);
+		kernel_panic("Swap read failed: %d\n", entry);
+	}
+	mutex_unlock(swap_lock);
+	swap_release(entry);
+}
+
+/*
+ * Point the swap state at dev, with slots slots counted in refs
+ */
+static void swap_setup(dev_t * dev, int slots, uint8_t * refs)
+{
+	swap_dev = dev;
+	swap_slots = slots;
+	swap_next = 0;
+	swap_refs = refs;
+	if (0 == swap_window) {
+		swap_window = vm_kas_get_aligned(ARCH_PAGE_SIZE, ARCH_PAGE_SIZE);
+	}
+}
+
+/*
+ * Use size bytes of dev as swap
+ */
+void swap_init(dev_t * dev, size_t size)
+{
+	static vm_swap_ops_t ops = {
+		put: swap_put,
+		get: swap_get,
+		dup: swap_dup,
+		release: swap_release
+	};
+
+	INIT_ONCE();
+
+	int slots = size >> ARCH_PAGE_SIZE_LOG2;
+
+	/* Slot reference counts live in their own kernel segment */
+	size_t refsize = (slots + ARCH_PAGE_SIZE - 1) & ~(ARCH_PAGE_SIZE - 1);
+	uint8_t * refs = vm_kas_get_aligned(refsize, ARCH_PAGE_SIZE);
+	map_putpp(kas, refs, vm_segment_anonymous(refs, refsize, SEGMENT_R | SEGMENT_W));
+
+	swap_setup(dev, slots, refs);
+	vm_set_swap(&ops);
+}
+
+void swap_test()
+{
+	static char disk[4 * ARCH_PAGE_SIZE];
+	static uint8_t refs[sizeof(disk) >> ARCH_PAGE_SIZE_LOG2];
+	static const char pattern[] = "Swap test pattern";
+
+	/* Test on a private disk, leaving any system swap as it was */
+	dev_t * olddev = swap_dev;
+	int oldslots = swap_slots;
+	int oldnext = swap_next;
+	uint8_t * oldrefs = swap_refs;
+	swap_setup(dev_static(disk, sizeof(disk)), sizeof(refs), refs);
+
+	char * p = vm_kas_get_aligned(ARCH_PAGE_SIZE, ARCH_PAGE_SIZE);
+	map_putpp(kas, p, vm_segment_anonymous(p, ARCH_PAGE_SIZE, SEGMENT_R | SEGMENT_W));
+	memcpy(p, pattern, sizeof(pattern));
+
+	/* Round trip the page through swap */
+	page_t page = vmap_get_page(0, p);
+	int entry = swap_put(page);
+	check_int_bounds(entry, 1, swap_slots, "Swap put failed");
+	memset(p, 0, sizeof(pattern));
+	swap_get(entry, page);
+	check_int_is(memcmp(p, pattern, sizeof(pattern)), 0, "Swap data mismatch");
+	check_int_is(swap_refs[entry-1], 0, "Swap entry not released");
+
+	swap_setup(olddev, oldslots, oldrefs);
+	swap_next = oldnext;
+}
@@ -40,7 +40,7 @@ static void lock_mark(void * p)
 	slab_gc_mark(lock->waiting);
 }
 
-static slab_type_t locks[1] = {SLAB_TYPE(sizeof(mutex_t), lock_mark, 0)};
+static slab_type_t locks[1] = {SLAB_TYPE_ALIGNED(sizeof(mutex_t), ARCH_CACHE_LINE, lock_mark, 0)};
 
 
 static void monitor_mark(void * p)
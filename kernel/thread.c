@@ -74,7 +74,7 @@ void * tls_get(int key)
 
 static void thread_mark(void * p);
 static void thread_finalize(void * p);
-static slab_type_t threads[1] = {SLAB_TYPE(sizeof(thread_t), thread_mark, thread_finalize)};
+static slab_type_t threads[1] = {SLAB_TYPE_FLAGS(sizeof(thread_t), ARCH_CACHE_LINE, SLAB_RESCAN, thread_mark, thread_finalize)};
 
 thread_t * thread_prequeue(thread_t * queue, thread_t * thread, tstate state)
 {
@@ -222,18 +222,171 @@ static void thread_gc_walk(void * p, void * key, void * d)
 	slab_gc_mark(key);
 }
 
-void thread_gc()
+static void thread_gc_roots()
 {
-	thread_cleanlocks();
-	slab_gc_begin();
 	slab_gc_mark(arch_get_thread());
 	for(int i=0; i<sizeof(queue)/sizeof(queue[0]); i++) {
 		slab_gc_mark(queue[i]);
 	}
 	slab_gc_mark(roots);
+}
+
+static void thread_gc_start(int full)
+{
+	thread_cleanlocks();
+	slab_gc_begin(full);
+	thread_gc_roots();
+}
+
+static void thread_gc_finish()
+{
+	/* Roots may have changed since the cycle started */
+	thread_gc_roots();
 	slab_gc_end();
 }
 
+/*
+ * Set while collecting, so allocations made by the GC itself don't
+ * try to assist it
+ */
+static int gc_busy;
+
+/*
+ * Full collection and sweep, finishing any incremental cycle in
+ * progress first
+ */
+void thread_gc()
+{
+	gc_busy = 1;
+	if (slab_gc_active()) {
+		thread_gc_finish();
+	}
+	thread_gc_start(1);
+	thread_gc_finish();
+	slab_sweep_step(INT32_MAX);
+	gc_busy = 0;
+}
+
+/*
+ * Start an incremental cycle, unless one is already running
+ */
+void thread_gc_begin()
+{
+	if (gc_busy || slab_gc_active()) {
+		return;
+	}
+
+	gc_busy = 1;
+	thread_gc_start(0);
+	gc_busy = 0;
+}
+
+/*
+ * Incremental collection, marking up to THREAD_GC_STEP objects of the
+ * current cycle, finishing it once marked, or sweeping up to
+ * THREAD_SWEEP_STEP slabs left from the last cycle. Once swept, a new
+ * cycle is started if start is set. Returns whether there's a cycle or
+ * sweep still in progress.
+ */
+#define THREAD_GC_STEP 256
+#define THREAD_SWEEP_STEP 16
+
+int thread_gc_work(int start)
+{
+	if (gc_busy) {
+		return 0;
+	}
+
+	gc_busy = 1;
+	if (slab_gc_active()) {
+		if (slab_gc_step(THREAD_GC_STEP)) {
+			thread_gc_finish();
+		}
+	} else if (slab_sweep_step(THREAD_SWEEP_STEP) && start) {
+		thread_gc_start(0);
+	}
+	gc_busy = 0;
+
+	return slab_gc_active() || !slab_sweep_step(0);
+}
+
+/*
+ * GC daemon.
+ *
+ * Allocating threads may hold locks the GC needs, so they only assist
+ * with marking and sweeping. Starting a cycle, and the final pause,
+ * which releases large objects and their segments, are left to the
+ * daemon, which allocators wake through thread_gc_wake.
+ */
+static int gc_wanted;
+
+static void thread_gc_wake()
+{
+	thread_lock(&gc_wanted);
+	gc_wanted = 1;
+	thread_broadcast(&gc_wanted);
+	thread_unlock(&gc_wanted);
+}
+
+static void thread_gc_daemon()
+{
+	thread_lock(&gc_wanted);
+	while(1) {
+		while(!gc_wanted) {
+			thread_wait(&gc_wanted);
+		}
+		gc_wanted = 0;
+		thread_unlock(&gc_wanted);
+
+		/* Finish the cycle, and start another if one is due */
+		while(thread_gc_work(slab_gc_due(0))) {
+			thread_yield();
+		}
+
+		thread_lock(&gc_wanted);
+	}
+}
+
+void thread_gc_init()
+{
+	INIT_ONCE();
+
+	if (0 == thread_fork()) {
+		thread_gc_daemon();
+	}
+}
+
+/*
+ * Called by the allocator, with no spin locks held, once GC is due, see
+ * slab_gc_pace
+ */
+void thread_gc_step()
+{
+	if (gc_busy) {
+		return;
+	}
+
+	gc_busy = 1;
+	if (slab_gc_active()) {
+		if (slab_gc_step(THREAD_GC_STEP)) {
+			/* Marked, bar the final pause */
+			thread_gc_wake();
+		}
+	} else if (slab_sweep_step(THREAD_SWEEP_STEP) && slab_gc_due(0)) {
+		thread_gc_wake();
+	}
+	gc_busy = 0;
+}
+
+/*
+ * Called from the idle loop, to make progress when there's nothing
+ * else to do. New cycles are only started if one is nearly due.
+ */
+void thread_gc_idle()
+{
+	thread_gc_work(slab_gc_due(1));
+}
+
 void thread_gc_root(void * p)
 {
 	if (0 == roots) {
@@ -101,6 +101,21 @@ page_t vnode_get_page( vnode_t * vnode, off_t offset )
 	return page;
 }
 
+/*
+ * Drop page from the page cache, if it is still the cached copy
+ */
+int vnode_uncache_page( vnode_t * vnode, off_t offset, page_t page )
+{
+	page_cache_key_t key[] = {{ vnode, offset }};
+
+	if (page == map_getpi(page_cache, key)) {
+		map_removepi(page_cache, key);
+		return 1;
+	}
+
+	return 0;
+}
+
 void vnode_put_page( vnode_t * vnode, off_t offset, page_t page )
 {
 	vnode->fs->fsops->put_page(vnode, offset, page);
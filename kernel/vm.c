@@ -108,6 +108,21 @@ struct address_info_t {
 #define VMPAGE_PINNED 0x1
 #define VMPAGE_ACCESSED 0x2
 #define VMPAGE_DIRTY 0x4
+#define VMPAGE_SHARED 0x8
+
+/*
+ * Swap operations. Swapped out anonymous pages are stored in their
+ * object as negated swap entries, which are never 0.
+ */
+typedef struct vm_swap_ops_s {
+	/* Write page out, returning the swap entry or 0 on failure */
+	int (*put)(page_t page);
+	/* Read entry into page, and release the entry */
+	void (*get)(int entry, page_t page);
+	/* Add or drop a reference to entry */
+	void (*dup)(int entry);
+	void (*release)(int entry);
+} vm_swap_ops_t;
 
 #endif
 
@@ -116,19 +131,21 @@ struct segment_anonymous_s {
 	segment_t segment;
 };
 
-static map_t * vmpages;
 map_t * kas;
-static slab_type_t segments[1] = {SLAB_TYPE(sizeof(segment_t), 0, 0)};
-static slab_type_t objects[1] = {SLAB_TYPE(sizeof(vmobject_t), 0, 0)};
+static slab_type_t segments[1] = {SLAB_TYPE_LAYOUT(sizeof(segment_t),
+	SLAB_PTR(segment_t, base) | SLAB_PTR(segment_t, dirty) | SLAB_PTR(segment_t, clean), 0)};
+/* anon.pages shares a word with direct.base and vnode.vnode */
+static void vm_object_finalize(void * p);
+static slab_type_t objects[1] = {SLAB_TYPE_LAYOUT(sizeof(vmobject_t),
+	SLAB_PTR(vmobject_t, ops) | SLAB_PTR(vmobject_t, anon.pages) | SLAB_PTR(vmobject_t, anon.clean), vm_object_finalize)};
+
 void vm_init()
 {
 	INIT_ONCE();
 
 	tree_init();
 	kas = tree_new(0, TREE_TREAP);
-	vmpages = vector_new();
 	thread_gc_root(kas);
-	thread_gc_root(vmpages);
 }
 
 static void vm_invalid_pointer(void * p, int write, int user, int present)
@@ -168,6 +185,7 @@ static int vm_resolve_address(void * p, address_info_t * info)
 	return 0;
 }
 
+static int vm_direct_map_large(map_t * as, segment_t * seg, void * p);
 void vm_page_fault(void * p, int write, int user, int present)
 {
 	address_info_t info[1];
@@ -178,9 +196,12 @@ void vm_page_fault(void * p, int write, int user, int present)
 		map_t * as = info->as;
 
 		if (offset < seg->size) {
-			/* Adjust p to page boundary */
+			/* Adjust p and offset to page boundary */
 			p = ARCH_PAGE_ALIGN(p);
-			if (!present) {
+			offset = (char*)p - (char*)seg->base;
+			if (!present && OBJECT_DIRECT == seg->dirty->type && vm_direct_map_large(as, seg, p)) {
+				/* Mapped with a large page */
+			} else if (!present) {
 				/* FIXME: This all needs review */
 				page_t page = seg->dirty->ops->get_page(seg->dirty, offset);
 				if (0 == page) {
@@ -191,7 +212,7 @@ void vm_page_fault(void * p, int write, int user, int present)
 					vmap_map(as, p, page, write && SEGMENT_W & seg->perms, SEGMENT_U & seg->perms);
 				}
 				vm_vmpage_map(page, as, p);
-				vm_vmpage_setflags(page, VMPAGE_ACCESSED | (write) ? VMPAGE_DIRTY : 0);
+				vm_vmpage_setflags(page, VMPAGE_ACCESSED | ((write) ? VMPAGE_DIRTY : 0) | ((as == kas) ? VMPAGE_PINNED : 0));
 			} else if (write && SEGMENT_W & seg->perms) {
 				page_t page = vmap_get_page(as, p);
 				vmap_map(as, p, page, write && SEGMENT_W & seg->perms, SEGMENT_U & seg->perms);
@@ -212,16 +233,45 @@ void vm_page_fault(void * p, int write, int user, int present)
 /*
  * Anonymous private memory object
  */
+static vm_swap_ops_t * vm_swap_ops;
+
+/*
+ * Read a swapped out page back into anon, unless another thread beat us to it
+ */
+static page_t vm_anon_swapin(vmobject_t * anon, off_t offset)
+{
+	map_key key = offset >> ARCH_PAGE_SIZE_LOG2;
+	page_t page = 0;
+
+	thread_lock(anon);
+	map_data data = map_get(anon->anon.pages, key);
+	if (data < 0) {
+		page = page_alloc();
+		if (0 == page) {
+			thread_unlock(anon);
+			KTHROW(OutOfMemoryException, "No page for swap in");
+		}
+		vm_swap_ops->get(-data, page);
+		map_put(anon->anon.pages, key, page);
+	} else {
+		page = data;
+	}
+	thread_unlock(anon);
+
+	return page;
+}
+
 static page_t vm_anon_get_page(vmobject_t * anon, off_t offset)
 {
-	page_t page = map_get(anon->anon.pages, offset >> ARCH_PAGE_SIZE_LOG2);
+	map_data data = map_get(anon->anon.pages, offset >> ARCH_PAGE_SIZE_LOG2);
+	page_t page = (data < 0) ? vm_anon_swapin(anon, offset) : data;
 
 	if (!page && anon->anon.clean) {
 		page = anon->anon.clean->ops->get_page(anon->anon.clean, offset);
 	}
 
 	if (!page) {
-		page = page_alloc();
+		page = page_alloc_zeroed();
 		map_put(anon->anon.pages, offset >> ARCH_PAGE_SIZE_LOG2, page);
 	}
 
@@ -247,6 +297,13 @@ static void vm_object_anon_copy_walk(void * p, map_key key, map_data data)
 {
 	vmobject_t * anon = (vmobject_t *)p;
 
+	if (data < 0) {
+		/* Swapped out, both objects now refer to the swap entry */
+		vm_swap_ops->dup(-data);
+	} else {
+		/* Page now belongs to both objects, so can't be paged out */
+		vm_vmpage_setflags(data, VMPAGE_SHARED);
+	}
 	map_put(anon->anon.pages, key, data);
 }
 
@@ -266,6 +323,72 @@ static vmobject_t * vm_object_anon(vmobject_t * clean)
 	return anon;
 }
 
+/*
+ * Swap entries of dead anonymous objects, released by the pageout
+ * daemon, as swap release can sleep and finalizers run with the slab
+ * lock held. Entries that don't fit stay allocated.
+ */
+#define VM_SWAP_DEFERRED 1024
+static int vm_swap_deferred_lock[1];
+static int vm_swap_deferred[VM_SWAP_DEFERRED];
+static int vm_swap_deferred_count;
+static void vm_pageout_wake();
+
+static void vm_swap_release_deferred()
+{
+	while(1) {
+		int entry = 0;
+
+		SPIN_AUTOLOCK(vm_swap_deferred_lock) {
+			if (vm_swap_deferred_count) {
+				entry = vm_swap_deferred[--vm_swap_deferred_count];
+			}
+		}
+		if (0 == entry) {
+			return;
+		}
+		vm_swap_ops->release(entry);
+	}
+}
+
+static void vm_object_anon_finalize_walk(void * p, map_key key, map_data data)
+{
+	int * deferred = p;
+
+	if (data > 0) {
+		page_usage_t * usage = page_get_usage(data);
+
+		/* Pages still mapped or shared with a copy are left alone */
+		if (usage && 0 == usage->ref && !(usage->flags & VMPAGE_SHARED)) {
+			page_free(data);
+		}
+	} else if (data < 0) {
+		SPIN_AUTOLOCK(vm_swap_deferred_lock) {
+			if (vm_swap_deferred_count < VM_SWAP_DEFERRED) {
+				vm_swap_deferred[vm_swap_deferred_count++] = -data;
+				*deferred = 1;
+			}
+		}
+	}
+}
+
+/*
+ * Free the pages of a dead anonymous object, and pass its swap entries
+ * to the pageout daemon
+ */
+static void vm_object_finalize(void * p)
+{
+	vmobject_t * object = (vmobject_t *)p;
+	int deferred = 0;
+
+	if (OBJECT_ANON == object->type) {
+		map_walk(object->anon.pages, vm_object_anon_finalize_walk, &deferred);
+	}
+	if (deferred) {
+		vm_pageout_wake();
+	}
+}
+
 static vmobject_t * vm_object_anon_copy(vmobject_t * from)
 {
 	check_int_is(from->type, OBJECT_ANON, "Clone object is not anonymous");
@@ -287,6 +410,22 @@ static page_t vm_direct_get_page(vmobject_t * direct, off_t offset)
 	return 0;
 }
 
+/*
+ * Map the large page around p, if it is entirely within the segment
+ */
+static int vm_direct_map_large(map_t * as, segment_t * seg, void * p)
+{
+	char * base = (char*)((uintptr_t)p & ~(ARCH_LARGE_PAGE_SIZE-1));
+	off_t offset = base - (char*)seg->base;
+
+	if (base < (char*)seg->base || offset + ARCH_LARGE_PAGE_SIZE > seg->size) {
+		return 0;
+	}
+
+	page_t page = vm_direct_get_page(seg->dirty, offset);
+	return vmap_map_large(as, base, page, SEGMENT_W & seg->perms, SEGMENT_U & seg->perms);
+}
+
 static vmobject_t * vm_object_direct( page_t base, int size)
 {
 	static vmobject_ops_t direct_ops = {
@@ -295,7 +434,7 @@ static vmobject_t * vm_object_direct( page_t base, int size)
 
 	vmobject_t * direct = slab_alloc(objects);
 	direct->ops = &direct_ops;
-	direct->type = OBJECT_ANON;
+	direct->type = OBJECT_DIRECT;
 	direct->direct.base = base;
 	direct->direct.size = size;
 	return direct;
@@ -380,6 +519,42 @@ segment_t * vm_segment_copy(segment_t * from, int private)
 	return seg;
 }
 
+typedef struct vm_segment_release_s {
+	segment_t * seg;
+	map_key from;
+} vm_segment_release_t;
+
+static void vm_segment_release_walk(void * p, map_key key, map_data data)
+{
+	vm_segment_release_t * release = (vm_segment_release_t *)p;
+	char * vp = (char*)release->seg->base + (key << ARCH_PAGE_SIZE_LOG2);
+
+	if (key < release->from) {
+		return;
+	} else if (data > 0) {
+		vm_vmpage_unmap(data, kas, vp);
+		if (vmap_ismapped(kas, vp)) {
+			vmap_unmap(kas, vp);
+		}
+		page_free(data);
+	} else if (data < 0) {
+		vm_swap_ops->release(-data);
+	}
+	map_put(release->seg->dirty->anon.pages, key, 0);
+}
+
+/*
+ * Free the pages of an anonymous kernel segment from offset onwards,
+ * leaving them unbacked
+ */
+void vm_segment_release(segment_t * seg, off_t offset)
+{
+	vm_segment_release_t release[] = {{ seg, offset >> ARCH_PAGE_SIZE_LOG2 }};
+
+	check_int_is(seg->dirty->type, OBJECT_ANON, "Released segment is not anonymous");
+	map_walk(seg->dirty->anon.pages, vm_segment_release_walk, release);
+}
+
 page_t vm_page_steal(void * p)
 {
 	address_info_t info[1];
@@ -418,17 +593,34 @@ void vm_kas_start(void * p)
 	kas_next = p;
 }
 
+/*
+ * Kernel VM is allocated down from the top, towards the heap.
+ */
+void * vm_kas_bottom()
+{
+	return kas_next;
+}
+
 void * vm_kas_get_aligned( size_t size, size_t align )
 {
 	static int lock[1];
 
 	arch_spin_lock(lock);
 	uintptr_t p = (uintptr_t)kas_next;
-	p += (align-1);
+	p -= size;
 	p &= ~(align-1);
-	kas_next = (void*)p + size;
+	if (heap && p < (uintptr_t)heap->base + heap->size) {
+		/* Would run into the heap */
+		p = 0;
+	} else {
+		kas_next = (void*)p;
+	}
 	arch_spin_unlock(lock);
 
+	if (0 == p) {
+		KTHROW(OutOfMemoryException, "Out of kernel address space");
+	}
+
 	return (void*)p;
 }
 
@@ -439,138 +631,414 @@ void * vm_kas_get( size_t size )
 
 static int vmpages_lock;
 
-typedef struct vmpage_s {
-	int count;
-	int flags;
-	int age;
-	struct {
-		asid as;
-		void * p;
-	} maps[];
-} vmpage_t;
+/*
+ * Reverse map. The first mapping of each page is kept in its page usage
+ * record, and any others in a chain of page_rmap_t records hanging off
+ * it, which page_free releases along with the usage.
+ *
+ * The address spaces aren't referenced for the GC. The kernel's is a
+ * root, and process address spaces are reachable from their processes,
+ * which must unmap their pages before dropping an address space.
+ */
+static int vm_vmpage_ismapped(page_usage_t * usage, asid as, void * p)
+{
+	if (usage->map.as == as && usage->map.p == p) {
+		return 1;
+	}
+
+	for(page_rmap_t * rmap = usage->rmap; rmap; rmap = rmap->next) {
+		if (rmap->as == as && rmap->p == p) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
 
 void vm_vmpage_map( page_t page, asid as, void * p )
 {
-	SPIN_AUTOLOCK(&vmpages_lock) {
-		vmpage_t * vmpage = map_getip(vmpages, page);
-		int count = 1;
-
-		if (vmpage) {
-			/* Check if we already have this mapping */
-			for(int i=0; i<vmpage->count; i++) {
-				if (vmpage->maps[i].as == as && vmpage->maps[i].p == p) {
-					spin_unlock(&vmpages_lock);
-					return;
-				}
-			}
+	page_usage_t * usage = page_get_usage(page);
+
+	if (0 == usage) {
+		/* Not RAM, nothing to track */
+		return;
+	}
 
-			count = vmpage->count + 1;
+	/*
+	 * Allocate any rmap before taking the lock, and retry if the page
+	 * gained a mapping in the meantime.
+	 */
+	page_rmap_t * rmap = 0;
+	int retry;
+
+	do {
+		retry = 0;
+		if (usage->ref && 0 == rmap) {
+			rmap = page_rmap_alloc();
 		}
 
-		vmpage = realloc(vmpage, sizeof(*vmpage) + count*sizeof(vmpage->maps[0]));
-		vmpage->count = count;
-		vmpage->maps[count-1].as = as;
-		vmpage->maps[count-1].p = p;
+		SPIN_AUTOLOCK(&vmpages_lock) {
+			if (0 == usage->ref) {
+				usage->map.as = as;
+				usage->map.p = p;
+				usage->ref = 1;
+			} else if (vm_vmpage_ismapped(usage, as, p)) {
+				/* Already mapped */
+			} else if (0 == rmap) {
+				retry = 1;
+			} else {
+				rmap->as = as;
+				rmap->p = p;
+				rmap->next = usage->rmap;
+				usage->rmap = rmap;
+				usage->ref++;
+				rmap = 0;
+			}
+		}
+	} while(retry);
 
-		/* vmpage might have changed in realloc, update it */
-		map_putip(vmpages, page, vmpage);
+	if (rmap) {
+		/* Not needed after all */
+		page_rmap_free(rmap);
 	}
 }
 
 void vm_vmpage_unmap( page_t page, asid as, void * p )
 {
+	page_usage_t * usage = page_get_usage(page);
+	page_rmap_t * unused = 0;
+
+	if (0 == usage) {
+		return;
+	}
+
 	SPIN_AUTOLOCK(&vmpages_lock) {
-		vmpage_t * vmpage = map_getip(vmpages, page);
-
-		if (vmpage)  {
-			for(int i=0; i<vmpage->count; i++) {
-				if (vmpage->maps[i].as == as && vmpage->maps[i].p == p) {
-					vmpage->maps[i].as = vmpage->maps[vmpage->count-1].as;
-					vmpage->maps[i].p = vmpage->maps[vmpage->count-1].p;
-					i = vmpage->count--;
-					spin_unlock(&vmpages_lock);
-					return;
+		if (0 == usage->ref) {
+			/* Not mapped */
+		} else if (usage->map.as == as && usage->map.p == p) {
+			unused = usage->rmap;
+			if (unused) {
+				/* Promote the next mapping into the usage record */
+				usage->map.as = unused->as;
+				usage->map.p = unused->p;
+				usage->rmap = unused->next;
+			}
+			usage->ref--;
+		} else {
+			for(page_rmap_t ** prmap = &usage->rmap; *prmap; prmap = &(*prmap)->next) {
+				if ((*prmap)->as == as && (*prmap)->p == p) {
+					unused = *prmap;
+					*prmap = unused->next;
+					usage->ref--;
+					break;
 				}
 			}
 		}
 	}
+
+	if (unused) {
+		page_rmap_free(unused);
+	}
 }
 
 void vm_vmpage_setflags(page_t page, int flags)
 {
-	SPIN_AUTOLOCK(&vmpages_lock) {
-		vmpage_t * vmpage = map_getip(vmpages, page);
+	page_usage_t * usage = page_get_usage(page);
 
-		if (vmpage)  {
-			vmpage->flags |= flags;
+	if (usage) {
+		SPIN_AUTOLOCK(&vmpages_lock) {
+			usage->flags |= flags;
 		}
 	}
 }
 
 void vm_vmpage_resetflags(page_t page, int flags)
 {
-	SPIN_AUTOLOCK(&vmpages_lock) {
-		vmpage_t * vmpage = map_getip(vmpages, page);
+	page_usage_t * usage = page_get_usage(page);
 
-		if (vmpage)  {
-			vmpage->flags &= ~flags;
+	if (usage) {
+		SPIN_AUTOLOCK(&vmpages_lock) {
+			usage->flags &= ~flags;
 		}
 	}
 }
 
-void vm_vmpage_trapwrites(page_t page)
+static void vm_vmpage_unmap_all(page_t page)
 {
-	SPIN_AUTOLOCK(&vmpages_lock) {
-		vmpage_t * vmpage = map_getip(vmpages, page);
-		if (vmpage)  {
-			for(int i=0; i<vmpage->count; i++) {
-				asid as = vmpage->maps[i].as;
-				void * p = vmpage->maps[i].p;
-
-				/* Mark each mapping as read only */
-				if (vmap_ismapped(as, p)) {
-					//int user = vmap_isuser(as, p);
-					//vmap_map(as, p, page, 0, user);
-					vmap_unmap(as, p);
+	page_usage_t * usage = page_get_usage(page);
+
+	if (usage) {
+		SPIN_AUTOLOCK(&vmpages_lock) {
+			if (usage->ref && vmap_ismapped(usage->map.as, usage->map.p)) {
+				vmap_unmap(usage->map.as, usage->map.p);
+			}
+			for(page_rmap_t * rmap = usage->rmap; rmap; rmap = rmap->next) {
+				if (vmap_ismapped(rmap->as, rmap->p)) {
+					vmap_unmap(rmap->as, rmap->p);
 				}
 			}
 		}
 	}
 }
 
+void vm_vmpage_trapwrites(page_t page)
+{
+	/* FIXME: Map read only rather than unmapping */
+	vm_vmpage_unmap_all(page);
+}
+
 void vm_vmpage_trapaccess(page_t page)
 {
-	SPIN_AUTOLOCK(&vmpages_lock) {
-		vmpage_t * vmpage = map_getip(vmpages, page);
-		if (vmpage)  {
-			for(int i=0; i<vmpage->count; i++) {
-				asid as = vmpage->maps[i].as;
-				void * p = vmpage->maps[i].p;
-
-				/* Remove each mapping */
-				if (vmap_ismapped(as, p)) {
-					vmap_unmap(as, p);
-				}
-			}
-		}
-	}
+	/* Remove each mapping */
+	vm_vmpage_unmap_all(page);
 }
 
 void vm_vmpage_age(page_t page)
 {
-	SPIN_AUTOLOCK(&vmpages_lock) {
-		vmpage_t * vmpage = map_getip(vmpages, page);
-		if (vmpage)  {
-			if (vmpage->age) {
+	page_usage_t * usage = page_get_usage(page);
+
+	if (usage && usage->ref) {
+		SPIN_AUTOLOCK(&vmpages_lock) {
+			if (usage->age) {
 				/* Already referenced before, add age */
-				vmpage->age >>= 1;
-				if (vmpage->flags & VMPAGE_ACCESSED) {
-					vmpage->age |= 0x100;
+				usage->age >>= 1;
+				if (usage->flags & VMPAGE_ACCESSED) {
+					usage->age |= 0x100;
 				}
 			} else {
 				/* First use */
-				vmpage->age = (vmpage->flags & VMPAGE_ACCESSED) ? 4 : 0;
+				usage->age = (usage->flags & VMPAGE_ACCESSED) ? 4 : 0;
 			}
 		}
 	}
 }
+
+/*
+ * Pageout daemon.
+ *
+ * Two handed clock over all of RAM. The front hand clears the accessed
+ * flag of each mapped page and unmaps it, so the next access faults it
+ * back in and sets the flag again. The back hand trails by
+ * VM_PAGEOUT_SPREAD pages, ages each page, and reclaims it if it hasn't
+ * been accessed since the front hand passed.
+ *
+ * Clean page cache pages are dropped from the cache, anonymous pages are
+ * written to swap. Kernel pages are pinned, as faulting them back
+ * in may need locks held by the faulting code.
+ *
+ * The daemon sleeps until the page allocator wakes it, then scans every
+ * VM_PAGEOUT_INTERVAL until the shortfall is made up. Direct reclaim
+ * also moves the hands itself, by up to VM_PAGEOUT_DIRECT pages, but
+ * only drops clean pages, leaving swap I/O to the daemon.
+ */
+#define VM_PAGEOUT_SPREAD 256
+#define VM_PAGEOUT_SCAN 1024
+#define VM_PAGEOUT_DIRECT 64
+#define VM_PAGEOUT_INTERVAL 100000
+
+static int vm_pageout_lock[1];
+static int vm_pageout_wanted;
+static int vm_pageout_sleeping;
+static int vm_pageout_scanning;
+static thread_t * vm_pageout_thread;
+static page_t vm_pageout_front;
+static page_t vm_pageout_back;
+
+/*
+ * Set the swap operations, returning the previous operations
+ */
+vm_swap_ops_t * vm_set_swap(vm_swap_ops_t * ops)
+{
+	vm_swap_ops_t * old = vm_swap_ops;
+	vm_swap_ops = ops;
+
+	return old;
+}
+
+static int vm_pageout_shortfall()
+{
+	int shortfall = 0;
+
+	for(enum page_zone_e zone=PAGE_ZONE_DMA; zone<PAGE_ZONES; zone++) {
+		int zshortfall = page_zone_shortfall(zone);
+		if (zshortfall > shortfall) {
+			shortfall = zshortfall;
+		}
+	}
+
+	return shortfall;
+}
+
+static int vm_pageout_candidate(page_usage_t * usage)
+{
+	return usage && usage->ref && !(usage->flags & VMPAGE_PINNED);
+}
+
+static void vm_pageout_release(page_t page, page_usage_t * usage)
+{
+	vm_vmpage_unmap_all(page);
+	while(usage->ref) {
+		vm_vmpage_unmap(page, usage->map.as, usage->map.p);
+	}
+	page_free(page);
+}
+
+static int vm_pageout_page(page_t page, page_usage_t * usage, int direct)
+{
+	map_t * as = usage->map.as;
+	void * p = usage->map.p;
+	segment_t * seg = vm_get_segment(as, p);
+
+	if (0 == seg) {
+		return 0;
+	}
+
+	off_t offset = (char*)p - (char*)seg->base;
+	if (OBJECT_ANON == seg->dirty->type && page == map_get(seg->dirty->anon.pages, offset >> ARCH_PAGE_SIZE_LOG2)) {
+		if (direct || usage->ref > 1 || usage->flags & VMPAGE_SHARED || 0 == vm_swap_ops) {
+			return 0;
+		}
+
+		int entry = vm_swap_ops->put(page);
+		if (0 == entry) {
+			return 0;
+		} else if (usage->flags & VMPAGE_ACCESSED) {
+			/* Used again while being written out */
+			vm_swap_ops->release(entry);
+			return 0;
+		}
+		map_put(seg->dirty->anon.pages, offset >> ARCH_PAGE_SIZE_LOG2, -entry);
+	} else if (seg->clean && OBJECT_VNODE == seg->clean->type && !(usage->flags & VMPAGE_DIRTY)) {
+		if (!vnode_uncache_page(seg->clean->vnode.vnode, offset + seg->read_offset, page)) {
+			return 0;
+		}
+	} else {
+		return 0;
+	}
+
+	vm_pageout_release(page, usage);
+
+	return 1;
+}
+
+static void vm_pageout_front_hand(page_t page)
+{
+	page_usage_t * usage = page_get_usage(page);
+
+	if (vm_pageout_candidate(usage)) {
+		vm_vmpage_resetflags(page, VMPAGE_ACCESSED);
+		vm_vmpage_trapaccess(page);
+	}
+}
+
+static void vm_pageout_back_hand(page_t page, int direct)
+{
+	page_usage_t * usage = page_get_usage(page);
+
+	if (vm_pageout_candidate(usage)) {
+		vm_vmpage_age(page);
+		if (0 == usage->age && !(usage->flags & VMPAGE_ACCESSED)) {
+			vm_pageout_page(page, usage, direct);
+		}
+	}
+}
+
+/*
+ * Move the hands up to budget pages, while there is a shortfall
+ */
+static void vm_pageout_scan(int budget, int direct)
+{
+	/* One scan at a time, the loser just leaves it to the winner */
+	if (arch_atomic_postinc(&vm_pageout_scanning)) {
+		return;
+	}
+
+	for(int i=0; i<budget && vm_pageout_shortfall() > 0; i++) {
+		vm_pageout_front = page_clock_next(vm_pageout_front);
+		vm_pageout_back = page_clock_next(vm_pageout_back);
+		vm_pageout_front_hand(vm_pageout_front);
+		vm_pageout_back_hand(vm_pageout_back, direct);
+	}
+
+	vm_pageout_scanning = 0;
+}
+
+/*
+ * Wake the daemon, safe with spinlocks held or from interrupts
+ */
+static void vm_pageout_wake()
+{
+	thread_t * thread = 0;
+
+	SPIN_AUTOLOCK(vm_pageout_lock) {
+		vm_pageout_wanted = 1;
+		if (vm_pageout_sleeping) {
+			vm_pageout_sleeping = 0;
+			thread = vm_pageout_thread;
+		}
+	}
+
+	if (thread) {
+		thread_resume(thread);
+	}
+}
+
+/*
+ * Sleep until vm_pageout_wake
+ */
+static void vm_pageout_sleep()
+{
+	spin_lock(vm_pageout_lock);
+	while(!vm_pageout_wanted) {
+		vm_pageout_sleeping = 1;
+		arch_get_thread()->state = THREAD_SLEEPING;
+		spin_unlock(vm_pageout_lock);
+		thread_schedule();
+		spin_lock(vm_pageout_lock);
+	}
+	vm_pageout_wanted = 0;
+	spin_unlock(vm_pageout_lock);
+}
+
+static void vm_pageout_reclaim(int zone, int direct)
+{
+	/*
+	 * Called from the page allocator, possibly with heap locks held, in
+	 * which case the daemon has to do it all.
+	 */
+	if (direct && !arch_in_atomic()) {
+		vm_pageout_scan(VM_PAGEOUT_DIRECT, 1);
+	}
+	vm_pageout_wake();
+}
+
+static void vm_pageout()
+{
+	while(1) {
+		vm_pageout_sleep();
+		vm_swap_release_deferred();
+		while(vm_pageout_shortfall() > 0) {
+			vm_pageout_scan(VM_PAGEOUT_SCAN, 0);
+			timer_sleep(VM_PAGEOUT_INTERVAL);
+		}
+	}
+}
+
+void vm_pageout_init()
+{
+	INIT_ONCE();
+
+	vm_pageout_back = page_clock_next(0);
+	vm_pageout_front = vm_pageout_back;
+	for(int i=0; i<VM_PAGEOUT_SPREAD; i++) {
+		vm_pageout_front = page_clock_next(vm_pageout_front);
+	}
+	page_set_reclaim(vm_pageout_reclaim);
+
+	if (0 == thread_fork()) {
+		/* Asleep, the daemon is on no queue, so keep it from the GC */
+		vm_pageout_thread = arch_get_thread();
+		thread_gc_root(vm_pageout_thread);
+		vm_pageout();
+	}
+}
@@ -0,0 +1,277 @@
+#include "zswap.h"
+
+#if INTERFACE
+#include <stddef.h>
+
+typedef struct zswap_stats_s {
+	/* Pages currently stored, and their compressed size */
+	int pages;
+	size_t bytes;
+	/* Pages that didn't compress well enough, or didn't fit */
+	int rejects;
+	/* Swap ins served from memory, or passed on to the backing swap */
+	int hits;
+	int misses;
+} zswap_stats_t;
+
+#endif
+
+/*
+ * Compressed in memory swap cache.
+ *
+ * Sits in front of the device swap, if any. Pages are LZ compressed into
+ * malloc'd buffers, indexed by entry in a vector. Pages that don't
+ * compress to ZSWAP_MAX_SIZE, or don't fit in the pool, go on to the
+ * backing swap.
+ *
+ * The low bit of an entry tells our entries from backing swap entries.
+ */
+#define ZSWAP_MAX_SIZE (ARCH_PAGE_SIZE * 3 / 4)
+#define ZSWAP_ENTRY(i) ((i) << 1 | 1)
+#define ZSWAP_BACKING(entry) ((entry) << 1)
+#define ZSWAP_IS_ENTRY(entry) ((entry) & 1)
+#define ZSWAP_INDEX(entry) ((entry) >> 1)
+
+typedef struct zswap_page_s {
+	int ref;
+	int size;
+	char data[];
+} zswap_page_t;
+
+static vm_swap_ops_t * zswap_backing;
+static map_t * zswap_pages;
+static int zswap_next;
+static int zswap_entries;
+static size_t zswap_max;
+static zswap_stats_t zswap_stats[1];
+static mutex_t zswap_lock[1];
+static char * zswap_window;
+static char zswap_buf[ZSWAP_MAX_SIZE];
+
+static zswap_page_t * zswap_get_page(int entry)
+{
+	zswap_page_t * zpage = map_getip(zswap_pages, ZSWAP_INDEX(entry));
+
+	if (0 == zpage) {
+		kernel_panic("Invalid zswap entry: %d\n", entry);
+	}
+
+	return zpage;
+}
+
+static int zswap_store(page_t page)
+{
+	int size;
+
+	if (zswap_stats->bytes >= zswap_max) {
+		return 0;
+	}
+
+	vmap_map(0, zswap_window, page, 0, 0);
+	size = lz_compress(zswap_window, ARCH_PAGE_SIZE, zswap_buf, sizeof(zswap_buf));
+	vmap_unmap(0, zswap_window);
+	if (0 == size) {
+		return 0;
+	}
+
+	for(int i=0; i<zswap_entries; i++) {
+		int index = (zswap_next + i) % zswap_entries + 1;
+		if (0 == map_getip(zswap_pages, index)) {
+			zswap_page_t * zpage = malloc_noptrs(sizeof(*zpage) + size);
+
+			zpage->ref = 1;
+			zpage->size = size;
+			memcpy(zpage->data, zswap_buf, size);
+			map_putip(zswap_pages, index, zpage);
+			zswap_next = index;
+			zswap_stats->pages++;
+			zswap_stats->bytes += size;
+
+			return ZSWAP_ENTRY(index);
+		}
+	}
+
+	return 0;
+}
+
+static int zswap_put(page_t page)
+{
+	int entry;
+
+	mutex_lock(zswap_lock);
+	entry = zswap_store(page);
+	if (0 == entry) {
+		zswap_stats->rejects++;
+	}
+	mutex_unlock(zswap_lock);
+
+	if (0 == entry && zswap_backing) {
+		int backing = zswap_backing->put(page);
+		entry = (backing) ? ZSWAP_BACKING(backing) : 0;
+	}
+
+	return entry;
+}
+
+static void zswap_release(int entry)
+{
+	if (!ZSWAP_IS_ENTRY(entry)) {
+		zswap_backing->release(ZSWAP_INDEX(entry));
+		return;
+	}
+
+	mutex_lock(zswap_lock);
+	zswap_page_t * zpage = zswap_get_page(entry);
+	if (0 == --zpage->ref) {
+		map_putip(zswap_pages, ZSWAP_INDEX(entry), 0);
+		zswap_stats->pages--;
+		zswap_stats->bytes -= zpage->size;
+	} else {
+		zpage = 0;
+	}
+	mutex_unlock(zswap_lock);
+
+	if (zpage) {
+		/* Don't leave the buffer for GC to find */
+		free(zpage);
+	}
+}
+
+static void zswap_dup(int entry)
+{
+	if (!ZSWAP_IS_ENTRY(entry)) {
+		zswap_backing->dup(ZSWAP_INDEX(entry));
+		return;
+	}
+
+	mutex_lock(zswap_lock);
+	zswap_get_page(entry)->ref++;
+	mutex_unlock(zswap_lock);
+}
+
+static void zswap_get(int entry, page_t page)
+{
+	if (!ZSWAP_IS_ENTRY(entry)) {
+		mutex_lock(zswap_lock);
+		zswap_stats->misses++;
+		mutex_unlock(zswap_lock);
+		zswap_backing->get(ZSWAP_INDEX(entry), page);
+		return;
+	}
+
+	mutex_lock(zswap_lock);
+	zswap_page_t * zpage = zswap_get_page(entry);
+	vmap_map(0, zswap_window, page, 1, 0);
+	int size = lz_decompress(zpage->data, zpage->size, zswap_window, ARCH_PAGE_SIZE);
+	vmap_unmap(0, zswap_window);
+	zswap_stats->hits++;
+	mutex_unlock(zswap_lock);
+
+	if (ARCH_PAGE_SIZE != size) {
+		kernel_panic("Corrupt zswap entry: %d\n", entry);
+	}
+	zswap_release(entry);
+}
+
+/*
+ * Point the zswap state at pages, holding up to max bytes, in front of
+ * backing
+ */
+static void zswap_setup(size_t max, map_t * pages, vm_swap_ops_t * backing)
+{
+	zswap_max = max;
+	/* Allow for pages compressing down to 64 bytes */
+	zswap_entries = max / 64;
+	zswap_next = 0;
+	zswap_pages = pages;
+	zswap_backing = backing;
+	if (0 == zswap_window) {
+		zswap_window = vm_kas_get_aligned(ARCH_PAGE_SIZE, ARCH_PAGE_SIZE);
+	}
+}
+
+/*
+ * Compress up to max bytes of swapped out pages in memory, in front of
+ * the current swap operations.
+ */
+void zswap_init(size_t max)
+{
+	static vm_swap_ops_t ops = {
+		put: zswap_put,
+		get: zswap_get,
+		dup: zswap_dup,
+		release: zswap_release
+	};
+
+	INIT_ONCE();
+
+	map_t * pages = vector_new();
+	thread_gc_root(pages);
+	zswap_setup(max, pages, 0);
+	zswap_backing = vm_set_swap(&ops);
+}
+
+void zswap_get_stats(zswap_stats_t * stats)
+{
+	mutex_lock(zswap_lock);
+	*stats = *zswap_stats;
+	mutex_unlock(zswap_lock);
+}
+
+void zswap_report()
+{
+	zswap_stats_t stats[1];
+	int swapins;
+
+	zswap_get_stats(stats);
+	swapins = stats->hits + stats->misses;
+	kernel_printk("zswap: %d pages in %d bytes, %d%% of original\n", stats->pages, stats->bytes,
+		(stats->pages) ? (int)(100 * stats->bytes / ((size_t)stats->pages * ARCH_PAGE_SIZE)) : 0);
+	kernel_printk("zswap: %d rejects, %d hits, %d misses, %d%% hit rate\n", stats->rejects, stats->hits, stats->misses,
+		(swapins) ? 100 * stats->hits / swapins : 0);
+}
+
+void zswap_test()
+{
+	/* Test on a private pool with no backing, leaving any system zswap as it was */
+	vm_swap_ops_t * oldbacking = zswap_backing;
+	map_t * oldpages = zswap_pages;
+	int oldnext = zswap_next;
+	size_t oldmax = zswap_max;
+	zswap_stats_t oldstats = *zswap_stats;
+	map_t * pages = vector_new();
+	zswap_setup(1 << 20, pages, 0);
+	memset(zswap_stats, 0, sizeof(zswap_stats));
+
+	char * p = vm_kas_get_aligned(ARCH_PAGE_SIZE, ARCH_PAGE_SIZE);
+	map_putpp(kas, p, vm_segment_anonymous(p, ARCH_PAGE_SIZE, SEGMENT_R | SEGMENT_W));
+
+	/* Compressible page goes to memory */
+	for(int i=0; i<ARCH_PAGE_SIZE; i++) {
+		p[i] = i % 61;
+	}
+	page_t page = vmap_get_page(0, p);
+	int entry = zswap_put(page);
+	check_int_is(ZSWAP_IS_ENTRY(entry), 1, "Compressible page not kept in memory");
+	memset(p, 0, ARCH_PAGE_SIZE);
+	zswap_get(entry, page);
+	for(int i=0; i<ARCH_PAGE_SIZE; i++) {
+		check_int_is(p[i], i % 61, "zswap data mismatch");
+	}
+
+	/* Random data doesn't compress, and with no backing swap stays put */
+	uint32_t seed = 1;
+	for(int i=0; i<ARCH_PAGE_SIZE; i++) {
+		seed = seed * 1103515245 + 12345;
+		p[i] = seed >> 16;
+	}
+	entry = zswap_put(page);
+	check_int_is(entry, 0, "Incompressible page kept in memory");
+	check_int_is(zswap_stats->rejects, 1, "Incompressible page not rejected");
+
+	zswap_report();
+
+	zswap_setup(oldmax, oldpages, oldbacking);
+	zswap_next = oldnext;
+	*zswap_stats = oldstats;
+}
@@ -18,7 +18,7 @@ typedef void * arena_state;
 #endif
 
 static void arena_mark(void * p);
-static slab_type_t arenas[1] = {SLAB_TYPE(sizeof(arena_t), arena_mark, 0)};
+static slab_type_t arenas[1] = {SLAB_TYPE_FLAGS(sizeof(arena_t), 0, SLAB_RESCAN, arena_mark, 0)};
 static arena_t * arena_create(size_t size)
 {
 	arena_t * arena = slab_alloc(arenas);
@@ -71,7 +71,8 @@ exception_def Error = { "Error", &Throwable };
 exception_def RuntimeException = { "RuntimeException", &Exception };
 
 static tls_key exception_key;
-static slab_type_t causes[1] = {SLAB_TYPE(sizeof(struct exception_cause), 0, 0)};
+static slab_type_t causes[1] = {SLAB_TYPE_LAYOUT(sizeof(struct exception_cause),
+	SLAB_PTR(struct exception_cause, type) | SLAB_PTR(struct exception_cause, file), 0)};
 
 enum estates { EXCEPTION_NEW = 0, EXCEPTION_TRYING, EXCEPTION_CATCHING, EXCEPTION_FINISHING };
 
@@ -0,0 +1,254 @@
+#include "lz.h"
+
+#if INTERFACE
+#include <stdint.h>
+#endif
+
+/*
+ * LZ77 compression, in the LZ4 block format.
+ *
+ * Each sequence is a token byte with the literal length in the high
+ * nibble and the match length less LZ_MINMATCH in the low nibble, either
+ * extended by 255 valued bytes when the nibble is 15. The literals then
+ * follow, then the little endian match offset. The last sequence is
+ * literals only.
+ *
+ * Input is limited to 64K, as match positions are 16-bit. The hash
+ * table is shared, which is safe as we never block while compressing.
+ */
+#define LZ_MINMATCH 4
+#define LZ_HASH_LOG2 10
+#define LZ_MAX_INPUT 0x10000
+
+static uint16_t lz_table[1 << LZ_HASH_LOG2];
+
+static uint32_t lz_read32(const uint8_t * p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int lz_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_LOG2);
+}
+
+static uint8_t * lz_putlen(uint8_t * op, uint8_t * oend, int len)
+{
+	for(; len >= 255; len -= 255) {
+		if (op >= oend) {
+			return 0;
+		}
+		*op++ = 255;
+	}
+	if (op >= oend) {
+		return 0;
+	}
+	*op++ = len;
+
+	return op;
+}
+
+/*
+ * Emit a sequence, or just literals if matchlen is 0
+ */
+static uint8_t * lz_sequence(uint8_t * op, uint8_t * oend, const uint8_t * literals, int litlen, int offset, int matchlen)
+{
+	uint8_t * token = op++;
+
+	if (op > oend) {
+		return 0;
+	}
+
+	*token = ((litlen < 15) ? litlen : 15) << 4;
+	if (litlen >= 15 && 0 == (op = lz_putlen(op, oend, litlen - 15))) {
+		return 0;
+	}
+	if (op + litlen > oend) {
+		return 0;
+	}
+	memcpy(op, literals, litlen);
+	op += litlen;
+
+	if (matchlen) {
+		if (op + 2 > oend) {
+			return 0;
+		}
+		*op++ = offset;
+		*op++ = offset >> 8;
+
+		matchlen -= LZ_MINMATCH;
+		*token |= (matchlen < 15) ? matchlen : 15;
+		if (matchlen >= 15 && 0 == (op = lz_putlen(op, oend, matchlen - 15))) {
+			return 0;
+		}
+	}
+
+	return op;
+}
+
+/*
+ * Compress size bytes from src into dst, returning the compressed size
+ * or 0 if it doesn't fit in max bytes.
+ */
+int lz_compress(const void * src, int size, void * dst, int max)
+{
+	const uint8_t * base = src;
+	const uint8_t * ip = base;
+	const uint8_t * anchor = base;
+	/* Matches must start 12 bytes and end 5 bytes before the end */
+	const uint8_t * mflimit = base + size - 12;
+	const uint8_t * matchlimit = base + size - 5;
+	uint8_t * op = dst;
+	uint8_t * oend = op + max;
+
+	check_int_bounds(size, 0, LZ_MAX_INPUT, "Compression input too big");
+	memset(lz_table, 0, sizeof(lz_table));
+
+	while(size > 12 && ip < mflimit) {
+		uint32_t v = lz_read32(ip);
+		int h = lz_hash(v);
+		const uint8_t * ref = base + lz_table[h];
+
+		lz_table[h] = ip - base;
+		if (ref < ip && lz_read32(ref) == v) {
+			const uint8_t * mp = ip + LZ_MINMATCH;
+			const uint8_t * rp = ref + LZ_MINMATCH;
+
+			while(mp < matchlimit && *mp == *rp) {
+				mp++;
+				rp++;
+			}
+			op = lz_sequence(op, oend, anchor, ip - anchor, ip - ref, mp - ip);
+			if (0 == op) {
+				return 0;
+			}
+			ip = anchor = mp;
+		} else {
+			ip++;
+		}
+	}
+
+	op = lz_sequence(op, oend, anchor, base + size - anchor, 0, 0);
+
+	return (op) ? op - (uint8_t*)dst : 0;
+}
+
+static const uint8_t * lz_getlen(const uint8_t * ip, const uint8_t * iend, int * len)
+{
+	if (15 == *len) {
+		int b;
+		do {
+			if (ip >= iend) {
+				return 0;
+			}
+			b = *ip++;
+			*len += b;
+		} while(255 == b);
+	}
+
+	return ip;
+}
+
+/*
+ * Decompress size bytes from src into dst, returning the decompressed
+ * size, or -1 if the input is corrupt or doesn't fit in max bytes.
+ */
+int lz_decompress(const void * src, int size, void * dst, int max)
+{
+	const uint8_t * ip = src;
+	const uint8_t * iend = ip + size;
+	uint8_t * op = dst;
+	uint8_t * oend = op + max;
+
+	while(ip < iend) {
+		int token = *ip++;
+		int len = token >> 4;
+
+		if (0 == (ip = lz_getlen(ip, iend, &len)) || ip + len > iend || op + len > oend) {
+			return -1;
+		}
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		if (ip == iend) {
+			/* Last sequence has no match */
+			break;
+		} else if (ip + 2 > iend) {
+			return -1;
+		}
+
+		int offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		len = token & 15;
+		if (0 == (ip = lz_getlen(ip, iend, &len))) {
+			return -1;
+		}
+		len += LZ_MINMATCH;
+		if (0 == offset || op - (uint8_t*)dst < offset || op + len > oend) {
+			return -1;
+		}
+
+		/* Byte copy, as the match may overlap the output */
+		const uint8_t * mp = op - offset;
+		while(len--) {
+			*op++ = *mp++;
+		}
+	}
+
+	return op - (uint8_t*)dst;
+}
+
+void lz_test()
+{
+	static uint8_t src[1024];
+	static uint8_t buf[1100];
+	static uint8_t out[1024];
+	int size;
+
+	/* Empty input is a single empty literal sequence */
+	size = lz_compress(src, 0, buf, sizeof(buf));
+	check_int_is(size, 1, "Empty input compressed size");
+	check_int_is(lz_decompress(buf, size, out, sizeof(out)), 0, "Empty input decompressed size");
+
+	/* Input too short to search for matches is all literals */
+	memcpy(src, "hello hello!", 12);
+	size = lz_compress(src, 12, buf, sizeof(buf));
+	check_int_is(size, 13, "Short input compressed size");
+	check_int_is(lz_decompress(buf, size, out, sizeof(out)), 12, "Short input decompressed size");
+	check_int_is(memcmp(src, out, 12), 0, "Short input mismatch");
+
+	/* Repeating input compresses to matches overlapping their output */
+	for(int i=0; i<sizeof(src); i++) {
+		src[i] = i % 7;
+	}
+	size = lz_compress(src, sizeof(src), buf, sizeof(buf));
+	check_int_bounds(size, 1, sizeof(src)/8, "Repeating input not compressed");
+	check_int_is(lz_decompress(buf, size, out, sizeof(out)), sizeof(src), "Repeating input decompressed size");
+	check_int_is(memcmp(src, out, sizeof(src)), 0, "Repeating input mismatch");
+
+	/* Doesn't fit */
+	check_int_is(lz_compress(src, sizeof(src), buf, 4), 0, "Compressed past max");
+	check_int_is(lz_decompress(buf, size, out, sizeof(out)-1), -1, "Decompressed past max");
+
+	/* Match of 8 copied from 1 byte back */
+	static const uint8_t overlap[] = { 0x14, 'a', 0x01, 0x00, 0x10, 'b' };
+	check_int_is(lz_decompress(overlap, sizeof(overlap), out, sizeof(out)), 10, "Overlapping match size");
+	check_int_is(memcmp(out, "aaaaaaaaab", 10), 0, "Overlapping match mismatch");
+
+	/* Corrupt streams */
+	static const uint8_t badoffset[] = { 0x10, 'a', 0x02, 0x00 };
+	static const uint8_t zerooffset[] = { 0x10, 'a', 0x00, 0x00 };
+	static const uint8_t longliteral[] = { 0x50, 'a', 'b' };
+	static const uint8_t longmatch[] = { 0x1f, 'a', 0x01, 0x00, 0x10 };
+	static const uint8_t truncliteral[] = { 0xf0 };
+	static const uint8_t truncoffset[] = { 0x10, 'a', 0x01 };
+	static const uint8_t truncmatch[] = { 0x1f, 'a', 0x01, 0x00 };
+	check_int_is(lz_decompress(badoffset, sizeof(badoffset), out, sizeof(out)), -1, "Offset before output accepted");
+	check_int_is(lz_decompress(zerooffset, sizeof(zerooffset), out, sizeof(out)), -1, "Zero offset accepted");
+	check_int_is(lz_decompress(longliteral, sizeof(longliteral), out, sizeof(out)), -1, "Literals past input accepted");
+	check_int_is(lz_decompress(longmatch, sizeof(longmatch), out, 16), -1, "Match past max accepted");
+	check_int_is(lz_decompress(truncliteral, sizeof(truncliteral), out, sizeof(out)), -1, "Truncated literal length accepted");
+	check_int_is(lz_decompress(truncoffset, sizeof(truncoffset), out, sizeof(out)), -1, "Truncated offset accepted");
+	check_int_is(lz_decompress(truncmatch, sizeof(truncmatch), out, sizeof(out)), -1, "Truncated match length accepted");
+}
@@ -480,7 +480,11 @@ void map_test(map_t * map, map_t * akmap)
 	map_walkpp(map, map_walk_dump, akmap);
 	map_walkpp_range(map, map_walk_dump, 0, "Christ", "Steven");
 	if (akmap) {
-		map_walkip_range(akmap, map_walk_dump, 0, map_arraykey1((map_key)akmap), map_arraykey1((map_key)akmap+1));
+		map_key from = map_arraykey1((map_key)akmap);
+		map_key to = map_arraykey1((map_key)akmap+1);
+		map_walkip_range(akmap, map_walk_dump, 0, from, to);
+		free((void*)from);
+		free((void*)to);
 	}
 
 	kernel_printk("%s LE Christ\n", map_getpp_cond(map, "Christ", MAP_LE));
@@ -6,44 +6,365 @@
 
 typedef struct slab_type {
 	uint32_t magic;
+	int lock;
 	size_t esize;
 	int count;
-	struct slab * first;
+	int flags;
+	/* Words holding pointers, with SLAB_PRECISE */
+	uint32_t ptrs;
+	/* Pages per slab */
+	int pages;
+	/* Object alignment, and the next data offset colour to use */
+	size_t align;
+	int colour;
+	int colours;
+	/* Slabs with some, no and all slots available */
+	struct slab * partial;
+	struct slab * full;
+	struct slab * empty;
+	/* Slabs left to sweep after the last GC, and empty slabs kept */
+	struct slab * unswept;
+	int retained;
+	/* All slabs as of the start of GC, in an order only GC changes */
+	struct slab * all;
+	/* Magazine depot, full and empty magazines */
+	int id;
+	struct slab_magazine * depot;
+	struct slab_magazine * spares;
+	/* Statistics, see slab_report */
+	int slabs;
+	uint32_t allocs;
+	uint32_t frees;
+	uint32_t gcfreed;
+	int lastfreed;
 	struct slab_type * next, * prev;
 	void (*mark)(void *);
 	void (*finalize)(void *);
 } slab_type_t;
 
-#define SLAB_TYPE(s, m, f) {.magic=0, .esize=s, .mark=m, .finalize=f}
+#define SLAB_TYPE_FLAGS(s, a, fl, m, f) {.magic=0, .esize=s, .align=a, .flags=fl, .mark=m, .finalize=f}
+#define SLAB_TYPE_ALIGNED(s, a, m, f) SLAB_TYPE_FLAGS(s, a, 0, m, f)
+#define SLAB_TYPE(s, m, f) SLAB_TYPE_ALIGNED(s, 0, m, f)
+#define SLAB_TYPE_LAYOUT(s, p, f) {.magic=0, .esize=s, .flags=SLAB_PRECISE, .ptrs=p, .finalize=f}
+#define SLAB_TYPE_NOPTRS(s, f) SLAB_TYPE_LAYOUT(s, 0, f)
+
+/*
+ * The type mark function scans memory outside the object, such as a
+ * stack or arena, which the GC write barrier doesn't cover.
+ */
+#define SLAB_RESCAN 0x1
+
+/*
+ * Objects only hold pointers in the words set in the type's ptrs, bit n
+ * for word n, so GC scans just those. SLAB_PTR is the bit for a pointer
+ * field, which must be in the first 32 words. Types without a mark
+ * function or layout are scanned conservatively, every word.
+ */
+#define SLAB_PRECISE 0x2
+#define SLAB_PTR(type, field) (1u << (offsetof(type, field) / sizeof(void*)))
 
 #endif
 
 exception_def OutOfMemoryException = { "OutOfMemoryException", &Exception };
 exception_def AllocationTooBigException = { "AllocationTooBigException", &Exception };
 
+/*
+ * Slab descriptors live outside the slab, with its available bitmap, so
+ * the allocator's own writes don't dirty the slab's pages, which are the
+ * write barrier. The only thing in the slab's pages other than objects
+ * is a head, written once, so slab_get can find the descriptor.
+ */
 typedef struct slab {
-	uint32_t magic;
+	char * base;
 	struct slab * next, * prev;
+	struct slab ** list;
+	struct slab * nextall;
 	slab_type_t * type;
+	int free;
+	int idle;
 	uint32_t * available;
-	uint32_t * finalize;
+	uint32_t * marked;
 	char * data;
 } slab_t;
 
+typedef struct slab_head {
+	uint32_t magic;
+	slab_t * slab;
+} slab_head_t;
+
+/*
+ * Each type is protected by its own lock, and the list of types by
+ * typespin.
+ *
+ * GC marks into a separate bitmap, so types stay usable while marking.
+ * Objects allocated during GC are marked as they're allocated. Only the
+ * type being swept is locked for its sweep.
+ *
+ * Mark bitmaps are kept outside the slabs, so marking doesn't write to
+ * slab pages, whose dirty bits are the write barrier for incremental
+ * marking.
+ */
 static slab_type_t * types;
+static int typespin[1];
+static int type_count;
+static int gc_active;
+static int gc_cycles;
+static int gc_majors;
+
+/*
+ * Empty slabs still empty after a whole GC cycle are returned to the page
+ * heap, keeping up to SLAB_EMPTY_RETAIN per type for new allocations.
+ */
+#define SLAB_EMPTY_RETAIN 1
+static tls_key slab_cache_key;
+static int sweep_pending;
+
+/*
+ * GC pacing.
+ *
+ * A cycle is due once the bytes allocated since the last one reach
+ * gc_ratio percent of the bytes it found live, and at least
+ * SLAB_GC_TRIGGER_MIN. Allocating threads then wake the GC daemon,
+ * and assist with marking and sweeping, a thread_gc_step for every
+ * SLAB_GC_ASSIST bytes they allocate, until the cycle is marked and
+ * swept. So threads that never idle still collect, in proportion to
+ * how much they allocate. Allocations with spin locks held, or from
+ * interrupt handlers, don't assist, as the GC may need those locks.
+ * The idle thread starts a cycle early, 1/SLAB_GC_IDLE_DIVISOR of the
+ * way to due.
+ */
+#define SLAB_GC_TRIGGER_MIN (256 << 10)
+#define SLAB_GC_ASSIST (16 << 10)
+#define SLAB_GC_IDLE_DIVISOR 4
+static int gc_ratio = 100;
+static size_t gc_allocated;
+static size_t gc_trigger = SLAB_GC_TRIGGER_MIN;
+static size_t gc_assist;
+static size_t gc_marked;
+static size_t gc_live;
+
+/*
+ * Collect once the heap grows by percent of the live data
+ */
+void slab_gc_set_ratio(int percent)
+{
+	gc_ratio = percent;
+}
+
+int slab_gc_due(int idle)
+{
+	return gc_allocated >= ((idle) ? gc_trigger / SLAB_GC_IDLE_DIVISOR : gc_trigger);
+}
+
+/*
+ * Account for size bytes allocated, assisting the GC if it's due
+ */
+static void slab_gc_pace(size_t size)
+{
+	gc_allocated += size;
+	if (gc_allocated < gc_assist || arch_in_atomic()) {
+		return;
+	}
+
+	if (gc_active || sweep_pending || slab_gc_due(0)) {
+		gc_assist = gc_allocated + SLAB_GC_ASSIST;
+		thread_gc_step();
+	}
+}
+
+static void slab_lock(int * lock)
+{
+	while(1) {
+		if (arch_spin_trylock(lock)) {
+			return;
+		}
+	}
+}
+
+static void slab_unlock(int * lock)
+{
+	arch_spin_unlock(lock);
+}
+
+/*
+ * Slabs for bigger objects span several pages, so they don't waste
+ * more than 1/SLAB_WASTE_RATIO of the slab in the header and unused
+ * tail. Multi-page slabs are aligned to their size, so slab_get can
+ * find the header from any page.
+ *
+ * The slab magic depends on the head address and descriptor, so object
+ * data in the other pages is unlikely to look like a slab head.
+ */
+#define SLAB_PAGES_MAX 16
+#define SLAB_WASTE_RATIO 8
+#define SLAB_MAGIC(head, slab) (0x5ab1e5ed ^ (uint32_t)(head) ^ (uint32_t)(slab))
+
+/*
+ * Objects start on a multiple of the type alignment, which is rounded
+ * into the object size. Successive slabs offset their data by a cache
+ * line colour, using up the slab's unused tail, so the same slot in
+ * different slabs maps to different cache sets.
+ */
+#define SLAB_ALIGN_DEFAULT sizeof(uint32_t)
+#define SLAB_ALIGN(p, a) (((uintptr_t)(p) + (a) - 1) & ~((uintptr_t)(a) - 1))
+#define SLAB_COLOUR_STEP(stype) (((stype)->align > ARCH_CACHE_LINE) ? (stype)->align : ARCH_CACHE_LINE)
+
+/*
+ * Mark bitmaps are carved out of heap pages of their own, as are slab
+ * descriptors and available bitmaps
+ */
+#define SLAB_MARKMAP_SIZE 128
+#define SLAB_MARKMAP_BITS (SLAB_MARKMAP_SIZE * 8)
+#define SLAB_OVERFLOW(slab) ((slab)->marked[SLAB_MARKMAP_SIZE / sizeof(uint32_t) - 1])
+static int markspin[1];
+static void ** markmaps;
+
+static void slab_markmap_free(uint32_t * marked)
+{
+	void ** map = (void**)marked;
+
+	slab_lock(markspin);
+	*map = markmaps;
+	markmaps = map;
+	slab_unlock(markspin);
+}
+
+static uint32_t * slab_markmap_alloc()
+{
+	void ** map;
+
+	slab_lock(markspin);
+	map = markmaps;
+	if (map) {
+		markmaps = *map;
+	}
+	slab_unlock(markspin);
+
+	if (0 == map) {
+		char * page = page_heap_alloc();
+
+		for(int i=SLAB_MARKMAP_SIZE; i<ARCH_PAGE_SIZE; i+=SLAB_MARKMAP_SIZE) {
+			slab_markmap_free((uint32_t*)(page + i));
+		}
+		map = (void**)page;
+	}
+	memset(map, 0, SLAB_MARKMAP_SIZE);
+
+	return (uint32_t*)map;
+}
+
+/*
+ * Pages in slabs, one bit per page, so slab_get can reject words that
+ * don't point into a slab without touching the page they point to.
+ * Each leaf is a heap page mapping SLAB_PAGEMAP_LEAF_PAGES pages,
+ * allocated when a slab is first put in its range.
+ *
+ * Large objects have page maps of their own, see below.
+ */
+#define SLAB_PAGEMAP_LEAF_PAGES (ARCH_PAGE_SIZE * 8)
+#define SLAB_PAGEMAP_LEAVES ((UINT32_MAX >> ARCH_PAGE_SIZE_LOG2) / SLAB_PAGEMAP_LEAF_PAGES + 1)
+static int pagemapspin[1];
+static uint32_t * pagemap[SLAB_PAGEMAP_LEAVES];
+
+static int slab_pagemap_test(uint32_t ** map, void * p)
+{
+	uint32_t page = (uint32_t)p >> ARCH_PAGE_SIZE_LOG2;
+	uint32_t * leaf = map[page / SLAB_PAGEMAP_LEAF_PAGES];
+
+	page %= SLAB_PAGEMAP_LEAF_PAGES;
+
+	return leaf && (leaf[page/32] & (0x80000000 >> page%32));
+}
+
+/*
+ * Set or clear the map bits of pages pages from base
+ */
+static void slab_pagemap_set(uint32_t ** map, void * base, int pages, int set)
+{
+	for(int i=0; i<pages; i++) {
+		uint32_t page = ((uint32_t)base >> ARCH_PAGE_SIZE_LOG2) + i;
+		uint32_t ** leaf = map + page / SLAB_PAGEMAP_LEAF_PAGES;
+		uint32_t * map = 0;
+
+		if (0 == *leaf && !set) {
+			/* Nothing to clear */
+			continue;
+		} else if (0 == *leaf) {
+			map = page_heap_alloc();
+			memset(map, 0, ARCH_PAGE_SIZE);
+		}
+
+		page %= SLAB_PAGEMAP_LEAF_PAGES;
+		slab_lock(pagemapspin);
+		if (0 == *leaf) {
+			*leaf = map;
+			map = 0;
+		}
+		if (set) {
+			(*leaf)[page/32] |= (0x80000000 >> page%32);
+		} else {
+			(*leaf)[page/32] &= ~(0x80000000 >> page%32);
+		}
+		slab_unlock(pagemapspin);
+
+		if (map) {
+			/* Lost a race for the leaf */
+			page_heap_free(map);
+		}
+	}
+}
+
+static int slab_type_count(slab_type_t * stype)
+{
+	/*           <-----------------d------------------>
+	 * | head |a|                  data                |
+	 *  <-----------------slab size------------------->
+	 * c*s = ssz-head-a = d
+	 */
+	size_t size = stype->pages << ARCH_PAGE_SIZE_LOG2;
+
+	/* Leave room to align the data */
+	int count = (size-sizeof(slab_head_t)-(stype->align-1)) / stype->esize;
+
+	/* Bitmaps are a fixed size, with the last mark word for SLAB_OVERFLOW */
+	return (count < SLAB_MARKMAP_BITS - 64) ? count : SLAB_MARKMAP_BITS - 64;
+}
+
+/*
+ * Offset of the first object in a slab with no colour
+ */
+static size_t slab_type_data(slab_type_t * stype)
+{
+	return SLAB_ALIGN(sizeof(slab_head_t), stype->align);
+}
+
+static void slab_type_colours(slab_type_t * stype)
+{
+	size_t size = stype->pages << ARCH_PAGE_SIZE_LOG2;
+	size_t data = slab_type_data(stype);
+	size_t step = SLAB_COLOUR_STEP(stype);
+	size_t slack = size - data - stype->count * stype->esize;
+
+	/* Data must start in the first page, for slab_get */
+	if (data + slack >= ARCH_PAGE_SIZE) {
+		slack = ARCH_PAGE_SIZE - data - 1;
+	}
+	stype->colours = slack / step + 1;
+	stype->colour = 0;
+}
 #if 0
 void slab_type_create(slab_type_t * stype, size_t esize, void (*mark)(void *), void (*finalize)(void *))
 {
-	stype->first = 0;
+	stype->partial = stype->full = stype->empty = 0;
 	stype->esize = esize;
 	stype->mark = mark;
 	stype->finalize = finalize;
 	stype->magic = 997 * 0xaf653de9 * (uint32_t)stype;
 
 	/*           <-----------------d------------------>
-	 * | slab_t |a|f|              data                |
+	 * | slab_t |a|m|              data                |
 	 *  <-----------------page size------------------->
-	 * data + a + f = ARCH_PAGE_SIZE-sizeof(slab_t)
+	 * data + a + m = ARCH_PAGE_SIZE-sizeof(slab_t)
 	 * c*s + c/8+4 + c/8+4 = psz-slab_t = d
 	 * 8*c*s + c + 32 + c + 32 = 8*d
 	 * 8*c*s + 2*c = 8*d - 64
@@ -58,38 +379,100 @@ void slab_type_create(slab_type_t * stype, size_t esize, void (*mark)(void *), v
 void slab_init()
 {
 	INIT_ONCE();
+
+	slab_cache_key = tls_get_key();
 }
 
-static slab_t * slab_new(slab_type_t * stype)
+/*
+ * Move slab to the list matching its available slot count
+ */
+static void slab_file(slab_t * slab)
 {
-	/* Allocate and map page */
-	slab_t * slab = page_heap_alloc();
+	slab_type_t * stype = slab->type;
+	slab_t ** list = (0 == slab->free) ? &stype->full : (stype->count == slab->free) ? &stype->empty : &stype->partial;
 
-	if (0 == stype->magic) {
-		/* Initialize type */
-		stype->first = 0;
-		stype->magic = 997 * 0xaf653de9 * (uint32_t)stype;
-
-		/*           <-----------------d------------------>
-		 * | slab_t |a|f|              data                |
-		 *  <-----------------page size------------------->
-		 * data + a + f = ARCH_PAGE_SIZE-sizeof(slab_t)
-		 * c*s + c/8+4 + c/8+4 = psz-slab_t = d
-		 * 8*c*s + c + 32 + c + 32 = 8*d
-		 * 8*c*s + 2*c = 8*d - 64
-		 * c*(8*s + 2) = 8*d - 64
-		 * c = (8*d - 64) / (8*s + 2)
-		 */
-		stype->count = (8*(ARCH_PAGE_SIZE-sizeof(slab_t))-64)/ (8 * stype->esize + 2);
-		LIST_APPEND(types, stype);
+	if (&stype->unswept == slab->list) {
+		/* Stays put until it's swept, which counts its slots */
+		return;
+	}
+	if (list != slab->list) {
+		if (slab->list) {
+			LIST_DELETE((*slab->list), slab);
+		}
+		LIST_PREPEND((*list), slab);
+		slab->list = list;
+	}
+}
+
+static void slab_type_init(slab_type_t * stype)
+{
+	stype->partial = stype->full = stype->empty = 0;
+	stype->magic = 997 * 0xaf653de9 * (uint32_t)stype;
+	if (0 == stype->align) {
+		stype->align = SLAB_ALIGN_DEFAULT;
+	}
+	stype->esize = SLAB_ALIGN(stype->esize, stype->align);
+
+	/* Use the fewest pages that keep the waste in bounds */
+	for(stype->pages = 1; stype->pages < SLAB_PAGES_MAX; stype->pages <<= 1) {
+		size_t size = stype->pages << ARCH_PAGE_SIZE_LOG2;
+		stype->count = slab_type_count(stype);
+		if (SLAB_WASTE_RATIO * (size - stype->count * stype->esize) <= size) {
+			break;
+		}
+	}
+	stype->count = slab_type_count(stype);
+	slab_type_colours(stype);
+	stype->depot = stype->spares = 0;
+	slab_lock(typespin);
+	stype->id = type_count++;
+	LIST_APPEND(types, stype);
+	slab_unlock(typespin);
+}
+
+/*
+ * Allocate a new slab, which slab_add then files. Called without the
+ * type lock, as it throws OutOfMemoryException, after giving back
+ * anything it got.
+ */
+static slab_t * slab_new(slab_type_t * stype)
+{
+	slab_head_t * head = page_heap_alloc_pages(stype->pages);
+	slab_t * volatile slab = 0;
+	uint32_t * volatile available = 0;
+	uint32_t * volatile marked = 0;
+	volatile int done = 0;
+
+	KTRY {
+		slab = (slab_t*)slab_markmap_alloc();
+		available = slab_markmap_alloc();
+		marked = slab_markmap_alloc();
+		slab->base = (char*)head;
+		slab_pagemap_set(pagemap, head, stype->pages, 1);
+		done = 1;
+	} KFINALLY {
+		if (!done) {
+			if (marked) {
+				slab_pagemap_set(pagemap, head, stype->pages, 0);
+				slab_markmap_free(marked);
+			}
+			if (available) {
+				slab_markmap_free(available);
+			}
+			if (slab) {
+				slab_markmap_free((uint32_t*)slab);
+			}
+			page_heap_free_pages(head, stype->pages);
+		}
 	}
-	slab->magic = stype->magic;
-	slab->type = stype;
-	slab->available = (uint32_t*)(slab+1);
-	slab->finalize = slab->available + (slab->type->count+32)/32;
-	slab->data = (char*)(slab->finalize + (slab->type->count+32)/32);
-	LIST_PREPEND(stype->first, slab);
 
+	slab->type = stype;
+	slab->free = stype->count;
+	slab->idle = 0;
+	slab->list = 0;
+	slab->available = available;
+	slab->marked = marked;
+	slab->next = slab->prev = slab;
 	for(int i=0; i<stype->count; i+=32) {
 		uint32_t mask = ~0 ;
 		if (stype->count-i < 32) {
@@ -101,28 +484,41 @@ static slab_t * slab_new(slab_type_t * stype)
 	return slab;
 }
 
-static int slabspin[1];
-static void slab_lock()
+/*
+ * File a slab from slab_new, and publish its head. Must be locked.
+ */
+static void slab_add(slab_type_t * stype, slab_t * slab)
 {
-	while(1) {
-		if (arch_spin_trylock(slabspin)) {
-			return;
-		}
-	}
+	slab_head_t * head = (slab_head_t*)slab->base;
+
+	stype->slabs++;
+	slab->data = slab->base + slab_type_data(stype);
+	slab->data += SLAB_COLOUR_STEP(stype) * stype->colour;
+	stype->colour = (stype->colour + 1) % stype->colours;
+	slab_file(slab);
+	slab->nextall = stype->all;
+	stype->all = slab;
+
+	head->slab = slab;
+	head->magic = SLAB_MAGIC(head, slab);
 }
 
-static void slab_unlock()
-{
-	arch_spin_unlock(slabspin);
-}
+static void slab_sweep_slab(slab_type_t * stype, slab_t * slab);
 
-void * slab_alloc(slab_type_t * stype)
+static void * slab_alloc_locked(slab_type_t * stype)
 {
-	slab_lock();
+	/* Fill partial slabs, swept as needed, before starting on empty slabs */
+	slab_t * slab = stype->partial;
 
-	slab_t * slab = stype->first ? stype->first : slab_new(stype);
+	while(0 == slab && stype->unswept) {
+		slab_sweep_slab(stype, stype->unswept);
+		slab = stype->partial;
+	}
+	if (0 == slab) {
+		slab = stype->empty;
+	}
 
-	while(slab) {
+	if (slab) {
 		for(int i=0; i<slab->type->count; i+=32) {
 			if (slab->available[i/32]) {
 				/* There is some available slots */
@@ -145,23 +541,206 @@ void * slab_alloc(slab_type_t * stype)
 				}
 
 				slab->available[i/32] &= ~mask;
+				if (gc_active) {
+					slab->marked[i/32] |= mask;
+				} else {
+					slab->marked[i/32] &= ~mask;
+				}
+				slab->free--;
+				slab->idle = 0;
+				slab_file(slab);
 
-				slab_unlock();
 				return slab->data + slab->type->esize*slot;
 			}
 		}
+	}
+
+	return 0;
+}
+
+static void * slab_alloc_uncached(slab_type_t * stype)
+{
+	slab_lock(&stype->lock);
+	if (0 == stype->magic) {
+		slab_type_init(stype);
+	}
+	void * p = slab_alloc_locked(stype);
+	slab_unlock(&stype->lock);
+
+	while(0 == p) {
+		/* Get a new slab unlocked, as that can throw */
+		slab_t * slab = slab_new(stype);
+
+		slab_lock(&stype->lock);
+		slab_add(stype, slab);
+		p = slab_alloc_locked(stype);
+		slab_unlock(&stype->lock);
+	}
 
-		LIST_NEXT(stype->first,slab);
-		if (0 == slab) {
-			slab = slab_new(stype);
+	return p;
+}
+
+/*
+ * Magazine layer.
+ *
+ * Each thread has a loaded magazine of free objects per slab type, which
+ * it allocates from and frees to without taking the slab lock. Empty and
+ * full magazines are exchanged with the type's depot, or filled in a
+ * batch from the slabs.
+ *
+ * Interrupt handlers run on the interrupted thread's cache, so if they
+ * find it busy they go straight to the slabs instead.
+ *
+ * Types with finalizers aren't cached, as cached objects have already
+ * been finalized. Depot magazines are dropped at the start of GC, which
+ * sweeps their objects, while loaded magazines keep their objects. The
+ * caches are bypassed during GC, so loaded magazines can't change after
+ * they're marked. Caches are SLAB_RESCAN, as loading a magazine doesn't
+ * write to the cache, so old caches are rescanned by minor cycles too.
+ */
+#define SLAB_MAGAZINE_SIZE 16
+#define SLAB_CACHE_TYPES 256
+
+typedef struct slab_magazine {
+	struct slab_magazine * next;
+	int rounds;
+	void * objs[SLAB_MAGAZINE_SIZE];
+} slab_magazine_t;
+
+typedef struct slab_cache {
+	thread_t * owner;
+	int busy;
+	slab_magazine_t * loaded[SLAB_CACHE_TYPES];
+} slab_cache_t;
+
+static void slab_cache_mark(void * p);
+static void slab_gc_mark_noscan(void * root);
+static slab_type_t caches[1] = {SLAB_TYPE_FLAGS(sizeof(slab_cache_t), 0, SLAB_RESCAN, slab_cache_mark, 0)};
+static slab_type_t magazines[1] = {SLAB_TYPE(sizeof(slab_magazine_t), 0, 0)};
+
+static slab_cache_t * slab_cache(slab_type_t * stype)
+{
+	if (0 == slab_cache_key || gc_active || 0 == stype->magic || stype->finalize || stype->id >= SLAB_CACHE_TYPES) {
+		return 0;
+	}
+
+	thread_t * thread = arch_get_thread();
+	slab_cache_t * cache = tls_get(slab_cache_key);
+	if (0 == cache || thread != cache->owner) {
+		/* No cache yet, or inherited from our parent in thread_fork */
+		cache = slab_alloc_uncached(caches);
+		memset(cache, 0, sizeof(*cache));
+		cache->owner = thread;
+		tls_set(slab_cache_key, cache);
+	}
+
+	return (cache->busy) ? 0 : cache;
+}
+
+static slab_magazine_t * slab_magazine_new()
+{
+	slab_magazine_t * mag = slab_alloc_uncached(magazines);
+	mag->rounds = 0;
+
+	return mag;
+}
+
+/*
+ * Load a magazine with objects to allocate
+ */
+static slab_magazine_t * slab_cache_load_full(slab_type_t * stype, slab_cache_t * cache)
+{
+	slab_magazine_t * mag = cache->loaded[stype->id];
+
+	if (0 == mag) {
+		mag = cache->loaded[stype->id] = slab_magazine_new();
+	}
+
+	if (0 == mag->rounds) {
+		slab_lock(&stype->lock);
+		if (stype->depot) {
+			/* Exchange our empty magazine for a full one */
+			mag->next = stype->spares;
+			stype->spares = mag;
+			mag = cache->loaded[stype->id] = stype->depot;
+			stype->depot = mag->next;
+		} else {
+			/* Fill half the magazine from the slabs */
+			while(mag->rounds < SLAB_MAGAZINE_SIZE/2 && (mag->objs[mag->rounds] = slab_alloc_locked(stype))) {
+				mag->rounds++;
+			}
 		}
+		slab_unlock(&stype->lock);
 	}
 
-	slab_unlock();
-	
-	KTHROW(OutOfMemoryException, "Out of memory");
-	/* Shouldn't get here */
-	return 0;
+	return mag;
+}
+
+/*
+ * Load a magazine with room for freed objects
+ */
+static slab_magazine_t * slab_cache_load_empty(slab_type_t * stype, slab_cache_t * cache)
+{
+	slab_magazine_t * mag = cache->loaded[stype->id];
+
+	if (mag && SLAB_MAGAZINE_SIZE == mag->rounds) {
+		/* Exchange our full magazine for an empty one */
+		cache->loaded[stype->id] = 0;
+		slab_lock(&stype->lock);
+		mag->next = stype->depot;
+		stype->depot = mag;
+		mag = stype->spares;
+		if (mag) {
+			stype->spares = mag->next;
+		}
+		slab_unlock(&stype->lock);
+	}
+
+	if (0 == mag) {
+		mag = slab_magazine_new();
+	}
+	cache->loaded[stype->id] = mag;
+
+	return mag;
+}
+
+static void slab_cache_mark(void * p)
+{
+	slab_cache_t * cache = (slab_cache_t *)p;
+
+	for(int i=0; i<SLAB_CACHE_TYPES; i++) {
+		slab_magazine_t * mag = cache->loaded[i];
+		if (mag) {
+			/* Keep the cached objects, but not what they refer to */
+			slab_gc_mark_noscan(mag);
+			for(int r=0; r<mag->rounds; r++) {
+				slab_gc_mark_noscan(mag->objs[r]);
+			}
+		}
+	}
+}
+
+void * slab_alloc(slab_type_t * stype)
+{
+	slab_gc_pace(stype->esize);
+
+	slab_cache_t * cache = slab_cache(stype);
+
+	/* Unlocked, so only approximate if interrupted */
+	stype->allocs++;
+
+	if (cache) {
+		cache->busy = 1;
+		slab_magazine_t * mag = slab_cache_load_full(stype, cache);
+		void * p = (mag->rounds) ? mag->objs[--mag->rounds] : 0;
+		cache->busy = 0;
+
+		if (p) {
+			return p;
+		}
+	}
+
+	return slab_alloc_uncached(stype);
 }
 
 void * slab_calloc(slab_type_t * stype)
@@ -172,77 +751,642 @@ void * slab_calloc(slab_type_t * stype)
 	return p;
 }
 
-static void slab_mark_available_all(slab_t * slab)
+/*
+ * Large objects.
+ *
+ * Allocations too big for the pools get their own anonymous kernel
+ * segment, with a header in the first page. Headers are indexed by
+ * address in a sorted array, itself in a kernel segment so the GC
+ * doesn't see it, which the GC walks to rescan them.
+ *
+ * slab_large_get finds headers from interior pointers without taking
+ * large_lock, using two page maps like the slab pagemap. largemap has
+ * a bit for every page of a live large object, so most words are
+ * rejected with one test, and largeheads a bit for each header page,
+ * found by searching back from the page pointed to.
+ *
+ * Released objects keep their segment and header page, but no other
+ * pages, for reuse by allocations of similar size.
+ */
+#define SLAB_LARGE_MAX (64 << 20)
+#define SLAB_LARGE_INDEX_PAGES 4
+#define SLAB_LARGE_INDEX_MAX (SLAB_LARGE_INDEX_PAGES * ARCH_PAGE_SIZE / sizeof(slab_large_t *))
+
+typedef struct slab_large {
+	uint32_t magic;
+	struct slab_large * next, * prev;
+	segment_t * seg;
+	size_t pages;
+	size_t size;
+	int marked;
+	int overflow;
+	int noptrs;
+} slab_large_t;
+
+#define SLAB_LARGE_MAGIC(large) ((uint32_t)(large) ^ 0x1a8ce0b1)
+
+static int large_lock[1];
+static uint32_t * largemap[SLAB_PAGEMAP_LEAVES];
+static uint32_t * largeheads[SLAB_PAGEMAP_LEAVES];
+static slab_large_t ** large_index;
+static int large_count;
+static slab_large_t * large_objects;
+static slab_large_t * large_released;
+
+/*
+ * Find the index slot for large, or where it would go. Must be locked.
+ */
+static int slab_large_find(void * p)
+{
+	int low = 0;
+	int high = large_count;
+
+	while(low < high) {
+		int mid = (low + high) / 2;
+		if ((char*)large_index[mid] <= (char*)p) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	/* low is the first object above p */
+	return low - 1;
+}
+
+/*
+ * Find the nearest header page at or below p's page, at most a maximum
+ * size object away
+ */
+static slab_large_t * slab_large_head(void * p)
+{
+	uint32_t page = (uint32_t)p >> ARCH_PAGE_SIZE_LOG2;
+	uint32_t mask = ~0u << (31 - page%32);
+
+	for(int words = SLAB_LARGE_MAX / ARCH_PAGE_SIZE / 32 + 1; words > 0; words--) {
+		uint32_t * leaf = largeheads[page / SLAB_PAGEMAP_LEAF_PAGES];
+		uint32_t heads = (leaf) ? leaf[page % SLAB_PAGEMAP_LEAF_PAGES / 32] & mask : 0;
+
+		if (heads) {
+			/* Lowest set bit is the highest page */
+			page = (page & ~31) + 31 - __builtin_ctz(heads);
+			return (slab_large_t *)(page << ARCH_PAGE_SIZE_LOG2);
+		} else if (page < 32) {
+			break;
+		}
+		page = (page & ~31) - 1;
+		mask = ~0u;
+	}
+
+	return 0;
+}
+
+static slab_large_t * slab_large_get(void * p)
+{
+	/* Most words don't point into a large object, so reject them first */
+	if (!slab_pagemap_test(largemap, p)) {
+		return 0;
+	}
+
+	/* Header pages stay mapped once used, so the magic can be checked */
+	slab_large_t * large = slab_large_head(p);
+	if (large && SLAB_LARGE_MAGIC(large) == large->magic && (char*)p >= (char*)(large+1) && (char*)p < (char*)(large+1) + large->size) {
+		return large;
+	}
+
+	return 0;
+}
+
+static void slab_large_index_init()
+{
+	INIT_ONCE();
+
+	size_t size = SLAB_LARGE_INDEX_PAGES * ARCH_PAGE_SIZE;
+	large_index = vm_kas_get_aligned(size, ARCH_PAGE_SIZE);
+	map_putpp(kas, large_index, vm_segment_anonymous(large_index, size, SEGMENT_R | SEGMENT_W));
+}
+
+static void * slab_large_alloc(size_t size, int noptrs)
+{
+	size_t pages = (size + sizeof(slab_large_t) + ARCH_PAGE_SIZE - 1) >> ARCH_PAGE_SIZE_LOG2;
+	slab_large_t * large = 0;
+
+	if (size > SLAB_LARGE_MAX) {
+		KTHROWF(AllocationTooBigException, "Allocation too big for malloc: %d", size);
+	}
+	slab_gc_pace(size);
+	slab_large_index_init();
+
+	/* Reuse a released segment of about the right size */
+	slab_lock(large_lock);
+	slab_large_t * released = large_released;
+	while(released) {
+		if (released->pages >= pages && released->pages < 2*pages) {
+			LIST_DELETE(large_released, released);
+			large = released;
+			break;
+		}
+		LIST_NEXT(large_released, released);
+	}
+	slab_unlock(large_lock);
+
+	if (0 == large) {
+		size_t len = pages << ARCH_PAGE_SIZE_LOG2;
+		void * p = vm_kas_get_aligned(len, ARCH_PAGE_SIZE);
+		segment_t * seg = vm_segment_anonymous(p, len, SEGMENT_R | SEGMENT_W);
+
+		map_putpp(kas, p, seg);
+		large = p;
+		large->seg = seg;
+		large->pages = pages;
+	}
+
+	large->size = size;
+	large->noptrs = noptrs;
+	large->marked = gc_active;
+	large->next = large->prev = large;
+
+	slab_lock(large_lock);
+	if (large_count == SLAB_LARGE_INDEX_MAX) {
+		LIST_APPEND(large_released, large);
+		slab_unlock(large_lock);
+		KTHROW(OutOfMemoryException, "Too many large objects");
+	}
+	int i = slab_large_find(large) + 1;
+	memmove(large_index + i + 1, large_index + i, sizeof(large_index[0]) * (large_count - i));
+	large_index[i] = large;
+	large_count++;
+	large->magic = SLAB_LARGE_MAGIC(large);
+	LIST_APPEND(large_objects, large);
+	slab_unlock(large_lock);
+
+	/* Header first, so any page found in largemap has its header */
+	slab_pagemap_set(largeheads, large, 1, 1);
+	slab_pagemap_set(largemap, large, large->pages, 1);
+
+	return large+1;
+}
+
+/*
+ * Unindex large. Must be locked.
+ */
+static void slab_large_unlink(slab_large_t * large)
+{
+	int i = slab_large_find(large);
+
+	memmove(large_index + i, large_index + i + 1, sizeof(large_index[0]) * (large_count - i - 1));
+	large_count--;
+	LIST_DELETE(large_objects, large);
+
+	slab_pagemap_set(largemap, large, large->pages, 0);
+	slab_pagemap_set(largeheads, large, 1, 0);
+	large->magic = 0;
+}
+
+/*
+ * Free the pages of unlinked large, without the lock held, as releasing
+ * the segment takes VM locks. The header page is kept, as it tracks the
+ * released segment for reuse.
+ */
+static void slab_large_release(slab_large_t * large)
+{
+	vm_segment_release(large->seg, ARCH_PAGE_SIZE);
+
+	slab_lock(large_lock);
+	LIST_APPEND(large_released, large);
+	slab_unlock(large_lock);
+}
+
+static void slab_large_free(slab_large_t * large)
+{
+	int live;
+
+	slab_lock(large_lock);
+	live = large->magic;
+	if (live) {
+		slab_large_unlink(large);
+	}
+	slab_unlock(large_lock);
+
+	if (live) {
+		slab_large_release(large);
+	}
+}
+
+/*
+ * Mark large, returning whether it wasn't already marked
+ */
+static int slab_large_mark(slab_large_t * large)
 {
-        for(int i=0; i<slab->type->count; i+=32) {
-                uint32_t mask = ~0 ;
-                if (slab->type->count-i < 32) {
-                        mask = ~(mask >> (slab->type->count-i));
-                }
-		slab->finalize[i/32] = slab->available[i/32];
-                slab->available[i/32] = mask;
-        }
+	int marked;
 
+	slab_lock(large_lock);
+	marked = large->marked;
+	large->marked = 1;
+	slab_unlock(large_lock);
+
+	return !marked;
+}
+
+/*
+ * Conservatively scan the pages of large that are backed, and dirty if
+ * dirty is set. The pages are only large's, so can be cleaned as they're
+ * scanned.
+ */
+static void slab_large_scan(slab_large_t * large, int dirty)
+{
+	char * p = (char*)(large+1);
+	char * end = p + large->size;
+
+	if (large->noptrs) {
+		return;
+	}
+	while(p < end) {
+		char * next = (char*)ARCH_PAGE_ALIGN(p) + ARCH_PAGE_SIZE;
+		if (next > end) {
+			next = end;
+		}
+		if (vmap_ismapped(0, p) && (!dirty || vmap_isdirty(0, p))) {
+			vmap_clean(0, p);
+			slab_gc_mark_range((void**)p, (void**)next);
+		}
+		p = next;
+	}
 }
 
-void slab_gc_begin()
+/*
+ * Get the ith large object, as of the start of the final pause, when
+ * only interrupt handlers might change the index.
+ */
+static slab_large_t * slab_large_index_get(int i)
 {
-	slab_lock();
-	slab_type_t * stype = types;
+	slab_large_t * large = 0;
+
+	slab_lock(large_lock);
+	if (i < large_count) {
+		large = large_index[i];
+	}
+	slab_unlock(large_lock);
 
-	/* Mark all elements available */
-	while(stype) {
-		slab_t * slab = stype->first;
+	return large;
+}
 
-		while(slab) {
-			slab_mark_available_all(slab);
-			LIST_NEXT(stype->first, slab);
+static void slab_large_gc_begin()
+{
+	slab_lock(large_lock);
+	slab_large_t * large = large_objects;
+	while(large) {
+		large->marked = 0;
+		LIST_NEXT(large_objects, large);
+	}
+	slab_unlock(large_lock);
+}
+
+static void slab_large_gc_end()
+{
+	slab_large_t * dead = 0;
+
+	slab_lock(large_lock);
+	slab_large_t * large = large_objects;
+	while(large) {
+		slab_large_t * next = large;
+		LIST_NEXT(large_objects, next);
+		if (!large->marked) {
+			slab_large_unlink(large);
+			LIST_APPEND(dead, large);
 		}
+		large = next;
+	}
+	slab_unlock(large_lock);
 
-		LIST_NEXT(types, stype);
+	while(dead) {
+		large = dead;
+		LIST_DELETE(dead, large);
+		slab_large_release(large);
+	}
+}
+
+static slab_type_t * slab_type_next(slab_type_t * stype)
+{
+	slab_lock(typespin);
+	LIST_NEXT(types, stype);
+	slab_unlock(typespin);
+
+	return stype;
+}
+
+/*
+ * Incremental marking.
+ *
+ * Marked objects still to be scanned are grey, and kept on the grey
+ * stack. slab_gc_step scans a bounded number of them, while mutators
+ * run between steps. Scanning an object only pushes what it refers to,
+ * so marking doesn't recurse, however deep the object graph.
+ *
+ * The stack grows a heap page at a time, up to SLAB_GREY_CHUNKS pages.
+ * If it can't grow, the object is left marked but unscanned, and its
+ * slab or large object is flagged. Once the stack is empty, the marked
+ * objects of flagged slabs and large objects are rescanned.
+ *
+ * Mutators may store a pointer to an unmarked object into an object
+ * already scanned. The hardware dirty bit of slab and large object
+ * pages is the write barrier: pages are cleaned at the start of a
+ * cycle, and the final pause in slab_gc_end rescans the marked objects
+ * on dirty pages. This catches every store, not just those in libk.
+ * Types with SLAB_RESCAN scan memory not covered by the barrier, so
+ * all their marked objects are rescanned in the final pause.
+ *
+ * Objects allocated during a cycle are marked, but not scanned, so
+ * their pointers are found through the write barrier.
+ *
+ * Generational collection.
+ *
+ * Most cycles are minor, and keep the marks left by the last cycle, so
+ * objects that survive a cycle stay marked, or tenured, and are neither
+ * traced again nor swept. Objects allocated between cycles are young
+ * and unmarked. Tracing from the roots stops at tenured objects, so
+ * the remembered set of old objects that may refer to young ones is
+ * the marked objects on pages dirtied since the last cycle, which are
+ * scanned when a minor cycle starts. Pages aren't cleaned between
+ * cycles, so the write barrier doubles as the card table. Minor cycles
+ * cost about as much as the young objects and dirty pages.
+ *
+ * Every SLAB_GC_MINORS_MAX cycles, or once the tenured data has grown
+ * to twice what the last major cycle found live, a major cycle clears
+ * all marks and traces the whole heap, collecting tenured garbage.
+ * Freed objects recycled through a thread's magazine keep their mark,
+ * so are tenured until the next major cycle.
+ */
+#define SLAB_GREY_CHUNKS 64
+#define SLAB_GC_MINORS_MAX 8
+#define SLAB_GREY_CHUNK_OBJS ((ARCH_PAGE_SIZE - 2 * sizeof(void*)) / sizeof(void*))
+
+typedef struct slab_grey {
+	struct slab_grey * prev;
+	int count;
+	void * objs[SLAB_GREY_CHUNK_OBJS];
+} slab_grey_t;
+
+static slab_grey_t * grey;
+static slab_grey_t * grey_spare;
+static int grey_chunks;
+static int grey_overflow;
+static int gc_major;
+static int gc_minors;
+static size_t gc_major_live;
+
+static slab_grey_t * slab_grey_chunk()
+{
+	slab_grey_t * chunk = grey_spare;
+
+	if (chunk) {
+		grey_spare = 0;
+	} else if (grey_chunks < SLAB_GREY_CHUNKS) {
+		KTRY {
+			chunk = page_heap_alloc();
+			grey_chunks++;
+		} KCATCH(OutOfMemoryException) {
+			chunk = 0;
+		}
+	}
+
+	return chunk;
+}
+
+/*
+ * Push p, marked in slab or large, on the grey stack
+ */
+static void slab_gc_grey(slab_t * slab, slab_large_t * large, void * p)
+{
+	if (0 == grey || SLAB_GREY_CHUNK_OBJS == grey->count) {
+		slab_grey_t * chunk = slab_grey_chunk();
+
+		if (0 == chunk) {
+			/* Leave p unscanned, for slab_gc_rescan_overflow */
+			if (slab) {
+				SLAB_OVERFLOW(slab) = 1;
+			} else {
+				large->overflow = 1;
+			}
+			grey_overflow = 1;
+			return;
+		}
+		chunk->prev = grey;
+		chunk->count = 0;
+		grey = chunk;
+	}
+	grey->objs[grey->count++] = p;
+}
+
+static void * slab_gc_pop()
+{
+	while(grey && 0 == grey->count) {
+		slab_grey_t * chunk = grey;
+
+		/* Keep one empty chunk for the next push */
+		grey = chunk->prev;
+		if (grey_spare) {
+			page_heap_free(chunk);
+			grey_chunks--;
+		} else {
+			grey_spare = chunk;
+		}
+	}
+
+	return (grey) ? grey->objs[--grey->count] : 0;
+}
+
+static int slab_gc_grey_empty()
+{
+	/* Only the top chunk can be partly full */
+	return 0 == grey || (0 == grey->count && 0 == grey->prev);
+}
+
+int slab_gc_active()
+{
+	return gc_active;
+}
+
+static slab_t * slab_get(void * p);
+static void slab_gc_rescan_dirty(int drain);
+
+/*
+ * Clear the mark of p, in slab. Must be locked.
+ */
+static void slab_unmark(slab_t * slab, void * p)
+{
+	int i = ((char*)p - slab->data) / slab->type->esize;
+
+	slab->marked[i/32] &= ~(0x80000000 >> i%32);
+}
+
+/*
+ * Unmark the magazines of a dropped depot, so a minor cycle sweeps them
+ */
+static void slab_magazines_unmark(slab_magazine_t * mag)
+{
+	for(; mag; mag = mag->next) {
+		slab_t * slab = slab_get(mag);
+
+		slab_lock(&magazines->lock);
+		slab_unmark(slab, mag);
+		slab_unlock(&magazines->lock);
+	}
+}
+
+/*
+ * Start a cycle, major if full is set or one is due, otherwise minor
+ */
+void slab_gc_begin(int full)
+{
+	/* Marks are needed until the last cycle is swept */
+	slab_sweep_step(INT32_MAX);
+
+	gc_active = 1;
+	gc_marked = 0;
+	grey_overflow = 0;
+	/* Nothing is tenured before the first cycle */
+	gc_major = full || 0 == gc_cycles || gc_minors >= SLAB_GC_MINORS_MAX || gc_live > 2 * gc_major_live;
+
+	/*
+	 * Major cycles clear all marks, and clean all pages for the write
+	 * barrier. Minor cycles keep both, the dirty pages being the
+	 * remembered set.
+	 */
+	for(slab_type_t * stype = types; stype; stype = slab_type_next(stype)) {
+		slab_t ** lists[] = { &stype->partial, &stype->full, &stype->empty };
+
+		slab_lock(&stype->lock);
+		stype->all = 0;
+		for(int l=0; l<sizeof(lists)/sizeof(lists[0]); l++) {
+			slab_t * slab = *lists[l];
+
+			while(slab) {
+				if (gc_major) {
+					memset(slab->marked, 0, sizeof(slab->marked[0]) * ((stype->count+32)/32));
+					for(int i=0; i<stype->pages; i++) {
+						vmap_clean(0, slab->base + (i << ARCH_PAGE_SIZE_LOG2));
+					}
+				}
+				slab->nextall = stype->all;
+				stype->all = slab;
+				LIST_NEXT((*lists[l]), slab);
+			}
+		}
+
+		/* Drop the depot, sweeping the objects in its magazines */
+		slab_magazine_t * depot = stype->depot;
+		slab_magazine_t * spares = stype->spares;
+		stype->depot = stype->spares = 0;
+		if (!gc_major) {
+			for(slab_magazine_t * mag = depot; mag; mag = mag->next) {
+				for(int r=0; r<mag->rounds; r++) {
+					slab_unmark(slab_get(mag->objs[r]), mag->objs[r]);
+				}
+			}
+		}
+		slab_unlock(&stype->lock);
+
+		if (!gc_major) {
+			slab_magazines_unmark(depot);
+			slab_magazines_unmark(spares);
+		}
+	}
+
+	if (gc_major) {
+		slab_large_gc_begin();
+	} else {
+		/* Grey the remembered set */
+		slab_gc_rescan_dirty(0);
 	}
 }
 
 static slab_t * slab_get(void * p)
 {
-	if (arch_is_heap_pointer(p)) {
-		/* Check magic numbers */
-		slab_t * slab = ARCH_PAGE_ALIGN(p);
+	/* Most words don't point into a slab, so reject them first */
+	if (!slab_pagemap_test(pagemap, p)) {
+		return 0;
+	}
+
+	/*
+	 * Try each slab size in turn, for the header of a multi-page slab.
+	 * Slabs are aligned to their size, so every page tried up to the
+	 * header is in p's slab, and mapped.
+	 */
+	for(int pages = 1; pages <= SLAB_PAGES_MAX; pages <<= 1) {
+		slab_head_t * head = (slab_head_t *)((uintptr_t)p & ~((pages << ARCH_PAGE_SIZE_LOG2) - 1));
 
-		if (slab == ARCH_PAGE_ALIGN(slab->data) && slab->magic == slab->type->magic && (char*)slab->data <= (char*)p) {
-			return slab;
+		if (!slab_pagemap_test(pagemap, head)) {
+			break;
+		}
+
+		/* Check magic numbers, as data pages may look like heads */
+		if (head->magic == SLAB_MAGIC(head, head->slab) && head->slab->base == (char*)head) {
+			slab_t * slab = head->slab;
+			char * end = slab->data + slab->type->count * slab->type->esize;
+			if (slab->type->pages == pages && (char*)slab->data <= (char*)p && (char*)p < end) {
+				return slab;
+			}
+			break;
 		}
 	}
 
 	return 0;
 }
 
-void slab_gc_mark(void * root)
+/*
+ * Does stype hold no pointers, so needn't be scanned
+ */
+static int slab_type_noptrs(slab_type_t * stype)
+{
+	return (stype->flags & SLAB_PRECISE) && 0 == stype->ptrs;
+}
+
+static void slab_gc_mark_object(void * root, int scan)
 {
 	slab_t * slab = slab_get(root);
 
 	if (slab) {
 		int i = ((char*)root - slab->data) / slab->type->esize;
 		int mask = (0x80000000 >> i%32);
-		if (slab->available[i/32] & mask) {
-			/* Marked as available, clear the mark */
-			slab->available[i/32] &= ~mask;
-			if (slab->type->mark) {
-				/* Call type specific mark */
-				slab->type->mark(root);
-			} else {
-				/* Call the generic conservative mark */
-				void ** p = (void**)root;
-				for(;p<(void**)root+slab->type->esize/sizeof(void*); p++) {
-					slab_gc_mark(*p);
-				}
-				p = 0;
+		int marked;
+
+		slab_lock(&slab->type->lock);
+		/* Only allocated objects need marking */
+		marked = (slab->available[i/32] | slab->marked[i/32]) & mask;
+		slab->marked[i/32] |= mask;
+		slab_unlock(&slab->type->lock);
+
+		if (!marked) {
+			gc_marked += slab->type->esize;
+		}
+
+		if (!marked && scan && !slab_type_noptrs(slab->type)) {
+			slab_gc_grey(slab, 0, slab->data + slab->type->esize*i);
+		}
+	} else if (scan) {
+		slab_large_t * large = slab_large_get(root);
+
+		if (large && slab_large_mark(large)) {
+			gc_marked += large->size;
+			if (!large->noptrs) {
+				slab_gc_grey(0, large, large+1);
 			}
 		}
 	}
 	slab=0;
 }
 
+void slab_gc_mark(void * root)
+{
+	slab_gc_mark_object(root, 1);
+}
+
+static void slab_gc_mark_noscan(void * root)
+{
+	slab_gc_mark_object(root, 0);
+}
+
 void slab_gc_mark_block(void ** block, size_t size)
 {
 	for(int i=0; i<size/sizeof(*block); i++) {
@@ -258,48 +1402,362 @@ void slab_gc_mark_range(void ** from, void ** to)
 	}
 }
 
+/*
+ * Mark just the words of block set in ptrs
+ */
+static void slab_gc_mark_precise(void ** block, uint32_t ptrs)
+{
+	for(; ptrs; ptrs >>= 1, block++) {
+		if (ptrs & 1) {
+			slab_gc_mark(*block);
+		}
+	}
+}
+
+/*
+ * Scan the object at p, marking what it refers to
+ */
+static void slab_gc_scan(void * p)
+{
+	slab_t * slab = slab_get(p);
+
+	if (slab) {
+		if (slab->type->mark) {
+			/* Call type specific mark */
+			slab->type->mark(p);
+		} else if (slab->type->flags & SLAB_PRECISE) {
+			slab_gc_mark_precise(p, slab->type->ptrs);
+		} else {
+			/* Call the generic conservative mark */
+			slab_gc_mark_block(p, slab->type->esize);
+		}
+	} else {
+		slab_large_t * large = slab_large_get(p);
+
+		if (large) {
+			slab_large_scan(large, 0);
+		}
+	}
+}
+
+/*
+ * Is slot i of slab allocated and marked
+ */
+static int slab_slot_marked(slab_t * slab, int i)
+{
+	uint32_t mask = 0x80000000 >> i%32;
+
+	return (slab->marked[i/32] & ~slab->available[i/32] & mask) != 0;
+}
+
+/*
+ * Scan grey objects until the stack is empty
+ */
+static void slab_gc_drain_stack()
+{
+	void * p;
+
+	while((p = slab_gc_pop())) {
+		slab_gc_scan(p);
+	}
+}
+
+/*
+ * Rescan the marked objects of slab overlapping [from, to), draining
+ * the grey stack after each if drain is set.
+ *
+ * The all list and bitmaps are read without the type lock, as threads
+ * don't run during GC steps or the final pause. Interrupt handlers can
+ * only prepend slabs to the all list.
+ */
+static void slab_gc_rescan_slab(slab_t * slab, char * from, char * to, int drain)
+{
+	size_t esize = slab->type->esize;
+	int first = (from > slab->data) ? (from - slab->data) / esize : 0;
+	int last = (to > slab->data) ? (to - slab->data + esize - 1) / esize : 0;
+
+	if (last > slab->type->count) {
+		last = slab->type->count;
+	}
+	for(int i=first; i<last; i++) {
+		if (slab_slot_marked(slab, i)) {
+			slab_gc_scan(slab->data + esize*i);
+			if (drain) {
+				slab_gc_drain_stack();
+			}
+		}
+	}
+}
+
+/*
+ * Rescan marked objects the write barrier says may have changed, and
+ * all marked objects of SLAB_RESCAN types. Unless drain is set, what
+ * they refer to is left on the grey stack.
+ */
+static void slab_gc_rescan_dirty(int drain)
+{
+	for(slab_type_t * stype = types; stype; stype = slab_type_next(stype)) {
+		size_t size = stype->pages << ARCH_PAGE_SIZE_LOG2;
+
+		if (slab_type_noptrs(stype)) {
+			continue;
+		}
+		for(slab_t * slab = stype->all; slab; slab = slab->nextall) {
+			if (stype->flags & SLAB_RESCAN) {
+				slab_gc_rescan_slab(slab, slab->data, slab->base + size, drain);
+				continue;
+			}
+			for(char * page = slab->base; page < slab->base + size; page += ARCH_PAGE_SIZE) {
+				if (vmap_isdirty(0, page)) {
+					vmap_clean(0, page);
+					slab_gc_rescan_slab(slab, page, page + ARCH_PAGE_SIZE, drain);
+				}
+			}
+		}
+	}
+
+	slab_large_t * large;
+	for(int i=0; (large = slab_large_index_get(i)); i++) {
+		if (large->marked) {
+			slab_large_scan(large, 1);
+			if (drain) {
+				slab_gc_drain_stack();
+			}
+		}
+	}
+}
+
+/*
+ * Rescan the marked objects of slabs and large objects that overflowed
+ * the grey stack
+ */
+static void slab_gc_rescan_overflow()
+{
+	for(slab_type_t * stype = types; stype; stype = slab_type_next(stype)) {
+		size_t size = stype->pages << ARCH_PAGE_SIZE_LOG2;
+
+		for(slab_t * slab = stype->all; slab; slab = slab->nextall) {
+			if (SLAB_OVERFLOW(slab)) {
+				SLAB_OVERFLOW(slab) = 0;
+				slab_gc_rescan_slab(slab, slab->data, slab->base + size, 1);
+			}
+		}
+	}
+
+	slab_large_t * large;
+	for(int i=0; (large = slab_large_index_get(i)); i++) {
+		if (large->overflow) {
+			large->overflow = 0;
+			slab_large_scan(large, 0);
+			slab_gc_drain_stack();
+		}
+	}
+}
+
+/*
+ * Scan grey objects until there are none left
+ */
+static void slab_gc_drain()
+{
+	do {
+		slab_gc_drain_stack();
+		if (grey_overflow) {
+			/* Overflow only happens when marking, so this terminates */
+			grey_overflow = 0;
+			slab_gc_rescan_overflow();
+		}
+	} while(!slab_gc_grey_empty() || grey_overflow);
+}
+
+/*
+ * Scan up to budget grey objects, returning whether marking is done
+ * bar the final pause.
+ */
+int slab_gc_step(int budget)
+{
+	void * p;
+
+	while(budget-- && (p = slab_gc_pop())) {
+		slab_gc_scan(p);
+	}
+	if (grey_overflow && slab_gc_grey_empty()) {
+		slab_gc_drain();
+	}
+
+	return slab_gc_grey_empty();
+}
+
 static void slab_finalize_clear_param(void * param)
 {
 	param = 0;
 }
 
-static void slab_finalize(slab_t * slab)
+/*
+ * Finalize and free allocated objects that weren't marked, returning
+ * how many were freed
+ */
+static int slab_sweep(slab_t * slab)
 {
-        for(int i=0; i<slab->type->count; i+=32) {
-		slab->finalize[i/32] ^= slab->available[i/32];
-	}
-        for(int i=0; i<slab->type->count; ) {
-		if (slab->finalize[i/32]) {
+	int freed = 0;
+
+	for(int i=0; i<slab->type->count; i+=32) {
+		uint32_t valid = ~0;
+		if (slab->type->count-i < 32) {
+			valid = ~(valid >> (slab->type->count-i));
+		}
+		uint32_t garbage = valid & ~slab->available[i/32] & ~slab->marked[i/32];
+
+		if (garbage && slab->type->finalize) {
 			uint32_t mask = 0x80000000;
-			for(; i<slab->type->count && mask; i++, mask>>=1) {
-				if (slab->finalize[i/32] & mask) {
-					slab->type->finalize(slab->data + slab->type->esize*i);
+			for(int j=i; j<slab->type->count && mask; j++, mask>>=1) {
+				if (garbage & mask) {
+					slab->type->finalize(slab->data + slab->type->esize*j);
 				}
 			}
-		} else {
-			i+=32;
+		}
+		slab->available[i/32] |= garbage;
+		for(; garbage; garbage &= garbage-1) {
+			freed++;
 		}
 	}
 	/* Clear parameter values left on stack */
 	slab_finalize_clear_param(0);
+
+	return freed;
 }
 
-void slab_gc_end()
+static int slab_count_available(slab_t * slab)
+{
+	int free = 0;
+
+	for(int i=0; i<slab->type->count; i+=32) {
+		for(uint32_t a = slab->available[i/32]; a; a &= a-1) {
+			free++;
+		}
+	}
+
+	return free;
+}
+
+static void slab_release(slab_t * slab)
 {
-	slab_type_t * stype = types;
+	slab_head_t * head = (slab_head_t*)slab->base;
+
+	/* Clear the magic, so stale pointers aren't taken as slab pointers */
+	head->magic = 0;
+	slab->type->slabs--;
+	slab_pagemap_set(pagemap, slab->base, slab->type->pages, 0);
+	slab_markmap_free(slab->marked);
+	slab_markmap_free(slab->available);
+	page_heap_free_pages(head, slab->type->pages);
+	slab_markmap_free((uint32_t*)slab);
+}
 
-	/* Finalize elements now available */
-	while(stype) {
-		slab_t * slab = stype->first;
+/*
+ * Sweep slab, and refile it or release it if it has stayed empty.
+ * Must be locked.
+ */
+static void slab_sweep_slab(slab_type_t * stype, slab_t * slab)
+{
+	int freed;
+
+	LIST_DELETE(stype->unswept, slab);
+	slab->list = 0;
+	sweep_pending--;
+
+	freed = slab_sweep(slab);
+	stype->lastfreed += freed;
+	stype->gcfreed += freed;
+	slab->free = slab_count_available(slab);
+	if (stype->count == slab->free) {
+		if (slab->idle && stype->retained >= SLAB_EMPTY_RETAIN) {
+			slab_release(slab);
+			return;
+		}
+		slab->idle = 1;
+		stype->retained++;
+	}
+	slab_file(slab);
+}
 
-		while(slab && stype->finalize) {
-			slab_finalize(slab);
-			LIST_NEXT(stype->first, slab);
+/*
+ * Lazy sweeping.
+ *
+ * The final pause only moves each type's slabs to its unswept list,
+ * bar types with finalizers, which it sweeps there and then.
+ * Allocation sweeps unswept slabs when it runs out of partial slabs,
+ * and slab_sweep_step sweeps up to budget slabs from the idle thread.
+ * The next cycle finishes sweeping before it clears the marks.
+ *
+ * The all list isn't updated for released slabs, and is rebuilt when
+ * a cycle starts. Returns whether sweeping is finished.
+ */
+int slab_sweep_step(int budget)
+{
+	for(slab_type_t * stype = types; stype && sweep_pending && budget > 0; stype = slab_type_next(stype)) {
+		slab_lock(&stype->lock);
+		while(stype->unswept && budget-- > 0) {
+			slab_sweep_slab(stype, stype->unswept);
+		}
+		slab_unlock(&stype->lock);
+	}
+
+	return 0 == sweep_pending;
+}
+
+/*
+ * Final pause, with the roots marked again. Rescan what the write
+ * barrier caught and finish marking, leaving the slabs to be swept.
+ */
+void slab_gc_end()
+{
+	slab_gc_rescan_dirty(1);
+	slab_gc_drain();
+
+	for(slab_type_t * stype = types; stype; stype = slab_type_next(stype)) {
+		slab_t ** lists[] = { &stype->partial, &stype->full, &stype->empty };
+
+		slab_lock(&stype->lock);
+		stype->lastfreed = 0;
+		stype->retained = 0;
+		for(int l=0; l<sizeof(lists)/sizeof(lists[0]); l++) {
+			while(*lists[l]) {
+				slab_t * slab = *lists[l];
+				LIST_DELETE((*lists[l]), slab);
+				LIST_APPEND(stype->unswept, slab);
+				slab->list = &stype->unswept;
+				sweep_pending++;
+			}
+		}
+		/*
+		 * Finalizers may look at other garbage, so run them now, before
+		 * lazy sweeping can reuse it
+		 */
+		while(stype->finalize && stype->unswept) {
+			slab_sweep_slab(stype, stype->unswept);
 		}
+		slab_unlock(&stype->lock);
+	}
 
-		LIST_NEXT(types, stype);
+	slab_large_gc_end();
+	gc_cycles++;
+
+	/* Pace the next cycle from what this one found live */
+	if (gc_major) {
+		gc_majors++;
+		gc_minors = 0;
+		gc_live = gc_major_live = gc_marked;
+	} else {
+		gc_minors++;
+		gc_live += gc_marked;
 	}
-	slab_unlock();
+	gc_trigger = gc_live / 100 * gc_ratio;
+	if (gc_trigger < SLAB_GC_TRIGGER_MIN) {
+		gc_trigger = SLAB_GC_TRIGGER_MIN;
+	}
+	gc_allocated = 0;
+	gc_assist = SLAB_GC_ASSIST;
+	gc_active = 0;
 }
 
 void slab_free(void * p)
@@ -307,16 +1765,78 @@ void slab_free(void * p)
 	slab_t * slab = slab_get(p);
 
 	if (slab) {
-		slab_lock();
+		slab_cache_t * cache = slab_cache(slab->type);
+
+		slab->type->frees++;
+		if (cache) {
+			cache->busy = 1;
+			slab_magazine_t * mag = slab_cache_load_empty(slab->type, cache);
+			mag->objs[mag->rounds++] = p;
+			cache->busy = 0;
+			return;
+		}
+
+		slab_lock(&slab->type->lock);
 		char * cp = p;
 		int i = (cp - slab->data) / slab->type->esize;
-		slab->available[i/32] |= (0x80000000 >> i%32);
+		if (0 == (slab->available[i/32] & (0x80000000 >> i%32))) {
+			slab->available[i/32] |= (0x80000000 >> i%32);
+			slab->free++;
+			slab_file(slab);
+		}
 		if (slab->type->finalize) {
 			slab->type->finalize(p);
 		}
 		p = 0;
-		slab_unlock();
+		slab_unlock(&slab->type->lock);
+	}
+}
+
+/*
+ * Print per type slab usage, and totals.
+ *
+ * Live objects include those cached in magazines, and garbage in slabs
+ * not yet swept. Overhead is the slab header, colour and unused tail,
+ * plus the off-slab descriptor and available and marked bitmaps, in
+ * bytes.
+ */
+void slab_report()
+{
+	size_t total = 0;
+	size_t totaloverhead = 0;
+	int totallive = 0;
+
+	kernel_printk("slab: %d GC cycles, %d major, %d bytes live, %d of %d bytes allocated to next cycle\n",
+		gc_cycles, gc_majors, gc_live, gc_allocated, gc_trigger);
+	for(slab_type_t * stype = types; stype; stype = slab_type_next(stype)) {
+		slab_t ** lists[] = { &stype->partial, &stype->full, &stype->empty, &stype->unswept };
+		size_t slabsize = stype->pages << ARCH_PAGE_SIZE_LOG2;
+		int live = 0;
+		int slabs;
+
+		slab_lock(&stype->lock);
+		for(int l=0; l<sizeof(lists)/sizeof(lists[0]); l++) {
+			slab_t * slab = *lists[l];
+
+			while(slab) {
+				live += stype->count - slab->free;
+				LIST_NEXT((*lists[l]), slab);
+			}
+		}
+		slabs = stype->slabs;
+		slab_unlock(&stype->lock);
+
+		/* Descriptor and both bitmaps are a markmap chunk each */
+		size_t overhead = slabs * (slabsize - stype->count * stype->esize + 3 * SLAB_MARKMAP_SIZE);
+		kernel_printk("slab: type %d, %d bytes in %d page slabs: %d slabs, %d live, %d bytes overhead\n",
+			stype->id, stype->esize, stype->pages, slabs, live, overhead);
+		kernel_printk("slab: type %d: %d allocs, %d frees, %d GC freed, %d in last GC\n",
+			stype->id, stype->allocs, stype->frees, stype->gcfreed, stype->lastfreed);
+		total += slabs * slabsize;
+		totaloverhead += overhead;
+		totallive += live;
 	}
+	kernel_printk("slab: %d live objects in %d bytes of slabs, %d bytes overhead\n", totallive, total, totaloverhead);
 }
 
 static void slab_test_finalize(void * p)
@@ -329,43 +1849,103 @@ static void slab_test_mark(void *p)
 	kernel_printk("Marking: %p\n", p);
 }
 
-static slab_type_t pools[] = {
-	SLAB_TYPE(8, 0, 0),
-	SLAB_TYPE(12, 0, 0),
-	SLAB_TYPE(16, 0, 0),
-	SLAB_TYPE(24, 0, 0),
-	SLAB_TYPE(32, 0, 0),
-	SLAB_TYPE(48, 0, 0),
-	SLAB_TYPE(64, 0, 0),
-	SLAB_TYPE(96, 0, 0),
-	SLAB_TYPE(128, 0, 0),
-	SLAB_TYPE(196, 0, 0),
-	SLAB_TYPE(256, 0, 0),
-	SLAB_TYPE(384, 0, 0),
-	SLAB_TYPE(512, 0, 0),
-	SLAB_TYPE(768, 0, 0),
-	SLAB_TYPE(1024, 0, 0),
-	SLAB_TYPE(1536, 0, 0),
-	SLAB_TYPE((ARCH_PAGE_SIZE-2*sizeof(uint32_t))/2, 0, 0),
-	SLAB_TYPE((ARCH_PAGE_SIZE-2*sizeof(uint32_t)), 0, 0),
-};
-
-void * malloc(size_t size)
+/*
+ * malloc size classes.
+ *
+ * Classes are 8 bytes apart up to 128 bytes, then 8 classes per power
+ * of two, which bounds internal fragmentation to 12.5%. Sizes are
+ * mapped to classes by table, in 8 byte steps up to 1024 bytes, and
+ * 128 byte steps up to SLAB_POOL_MAX.
+ *
+ * malloc_noptrs has its own pools of the same classes, for memory that
+ * holds no pointers, so GC doesn't scan it.
+ */
+#define SLAB_POOL_COUNT 64
+#define SLAB_POOL_MAX 8192
+#define SLAB_POOL_SMALL 1024
+#define SLAB_POOL_SMALL_STEP 8
+#define SLAB_POOL_LARGE_STEP 128
+
+static slab_type_t pools[SLAB_POOL_COUNT];
+static slab_type_t pools_noptrs[SLAB_POOL_COUNT];
+static uint8_t pool_small[SLAB_POOL_SMALL/SLAB_POOL_SMALL_STEP+1];
+static uint8_t pool_large[SLAB_POOL_MAX/SLAB_POOL_LARGE_STEP+1];
+static int pools_ready;
+
+static void slab_pools_init()
 {
-	for(int i=0; i<sizeof(pools)/sizeof(pools[0]);i++) {
-		if (pools[i].esize > size) {
-			return slab_alloc(pools+i);
+	size_t esize = 0;
+
+	for(int i=0; i<SLAB_POOL_COUNT; i++) {
+		if (esize < 128) {
+			esize += 8;
+		} else {
+			/* Step is an eighth of the preceding power of two */
+			size_t step = 16;
+			while(step * 16 <= esize) {
+				step <<= 1;
+			}
+			esize += step;
 		}
+		pools[i].esize = esize;
+		pools_noptrs[i].esize = esize;
+		pools_noptrs[i].flags = SLAB_PRECISE;
 	}
 
-	KTHROWF(AllocationTooBigException, "Allocation too big for malloc: %d", size);
+	for(int i=0, c=0; i<sizeof(pool_small); i++) {
+		while(pools[c].esize < i * SLAB_POOL_SMALL_STEP) {
+			c++;
+		}
+		pool_small[i] = c;
+	}
+	for(int i=0, c=0; i<sizeof(pool_large); i++) {
+		while(pools[c].esize < i * SLAB_POOL_LARGE_STEP) {
+			c++;
+		}
+		pool_large[i] = c;
+	}
 
-	/* Never reached */
-	return 0;
+	pools_ready = 1;
+}
+
+static void * slab_malloc(slab_type_t * classes, size_t size)
+{
+	if (0 == pools_ready) {
+		slab_pools_init();
+	}
+
+	if (size <= SLAB_POOL_SMALL) {
+		return slab_alloc(classes + pool_small[(size + SLAB_POOL_SMALL_STEP - 1) / SLAB_POOL_SMALL_STEP]);
+	} else if (size <= SLAB_POOL_MAX) {
+		return slab_alloc(classes + pool_large[(size + SLAB_POOL_LARGE_STEP - 1) / SLAB_POOL_LARGE_STEP]);
+	}
+
+	return slab_large_alloc(size, classes == pools_noptrs);
+}
+
+void * malloc(size_t size)
+{
+	return slab_malloc(pools, size);
+}
+
+/*
+ * Allocate memory that will hold no pointers to GC managed memory, such
+ * as strings and data buffers
+ */
+void * malloc_noptrs(size_t size)
+{
+	return slab_malloc(pools_noptrs, size);
 }
 
 void free(void *p)
 {
+	slab_large_t * large = slab_large_get(p);
+
+	if (large) {
+		slab_large_free(large);
+	} else {
+		slab_free(p);
+	}
 }
 
 void * calloc(size_t num, size_t size)
@@ -391,10 +1971,28 @@ void *realloc(void *p, size_t size)
 			/* Nothing to do, new memory fits in existing slot */
 			return p;
 		} else {
-			void * new = malloc(size);
+			void * new = (slab_type_noptrs(slab->type)) ? malloc_noptrs(size) : malloc(size);
 
 			/* Copy old data (of old size) to new buffer */
-			return memcpy(new, p, slab->type->esize);
+			memcpy(new, p, slab->type->esize);
+			free(p);
+
+			return new;
+		}
+	}
+
+	slab_large_t * large = slab_large_get(p);
+
+	if (large) {
+		if (size <= large->size) {
+			return p;
+		} else {
+			void * new = (large->noptrs) ? malloc_noptrs(size) : malloc(size);
+
+			memcpy(new, p, large->size);
+			free(p);
+
+			return new;
 		}
 	} else {
 		/* FIXME: We should do something here to warn of misuse */
@@ -408,7 +2006,13 @@ void *realloc(void *p, size_t size)
 void slab_test()
 {
 	static slab_type_t t[1] = {SLAB_TYPE(1270, slab_test_mark, slab_test_finalize)};
+	static slab_type_t aligned[1] = {SLAB_TYPE_ALIGNED(40, ARCH_CACHE_LINE, 0, 0)};
 	void * p[4];
+	slab_t * slab;
+
+	p[0] = slab_alloc(aligned);
+	check_int_is((uintptr_t)p[0] & (ARCH_CACHE_LINE-1), 0, "Misaligned slab object");
+	slab_free(p[0]);
 
 	p[0] = slab_alloc(t);
 	p[1] = slab_alloc(t);
@@ -426,4 +2030,48 @@ void slab_test()
 	p[0] = p[1] = p[2] = p[3] = realloc(p[0], 1736);
 
 	thread_gc();
+
+	/* Large objects */
+	p[0] = malloc(3*ARCH_PAGE_SIZE);
+	memset(p[0], 0, 3*ARCH_PAGE_SIZE);
+	p[0] = realloc(p[0], 5*ARCH_PAGE_SIZE);
+	p[1] = malloc(2*ARCH_PAGE_SIZE);
+	free(p[1]);
+	p[1] = 0;
+
+	thread_gc();
+	check_not_null(slab_large_get(p[0]), "Live large object collected");
+	check_int_is(slab_large_get((char*)p[0] + 4*ARCH_PAGE_SIZE) == slab_large_get(p[0]), 1, "Large object not found from its last page");
+	check_int_is(slab_pagemap_test(pagemap, p[0]), 0, "Large object in slab pagemap");
+
+	/* Pointer free memory stays pointer free when reallocated */
+	p[2] = realloc(malloc_noptrs(16), 600);
+	check_int_is(slab_type_noptrs(slab_get(p[2])->type), 1, "realloc lost malloc_noptrs");
+	p[2] = 0;
+
+	/* Move a reference between objects during an incremental cycle */
+	void ** holder = p[1] = malloc(2*sizeof(void*));
+	holder[0] = malloc(24);
+	holder[1] = 0;
+	thread_gc_begin();
+	while(slab_gc_active()) {
+		holder[1] = holder[0];
+		holder[0] = 0;
+		thread_gc_work(0);
+	}
+	slab = slab_get(holder[1]);
+	check_not_null(slab, "Live object collected");
+	check_int_is(slab_slot_marked(slab, ((char*)holder[1] - slab->data) / slab->type->esize), 1, "Live object not marked");
+
+	/* Holder is now tenured, so a minor cycle finds its new reference through the remembered set */
+	holder[0] = malloc(24);
+	thread_gc_begin();
+	while(slab_gc_active()) {
+		thread_gc_work(0);
+	}
+	slab = slab_get(holder[0]);
+	check_not_null(slab, "Remembered object collected");
+	check_int_is(slab_slot_marked(slab, ((char*)holder[0] - slab->data) / slab->type->esize), 1, "Remembered object not marked");
+
+	slab_report();
 }
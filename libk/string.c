@@ -29,11 +29,28 @@ void *memcpy(void *dest, const void *src, size_t n)
 	return dest;
 }
 
+void *memmove(void *dest, const void *src, size_t n)
+{
+	const char * cs = src;
+	char * cd = dest;
+
+	if (cd < cs) {
+		return memcpy(dest, src, n);
+	}
+
+	/* Copy backwards, in case the destination overlaps the end of src */
+	for(int i=n-1; i>=0; i--) {
+		cd[i] = cs[i];
+	}
+
+	return dest;
+}
+
 int memcmp(const void *s1, const void *s2, size_t n)
 {
-	const char * c1 = s1;
-	const char * c2 = s2;
-	for(int i=0; i<n; i++) {
+	const unsigned char * c1 = s1;
+	const unsigned char * c2 = s2;
+	for(int i=0; i<n; i++, c1++, c2++) {
 		if (*c1<*c2) {
 			return -1;
 		} else if (*c1>*c2) {
@@ -87,7 +104,7 @@ char * strdup( const char * s)
 
 char * strndup( const char * s, int len)
 {
-	char * ret = malloc(len + 1);
+	char * ret = malloc_noptrs(len + 1);
 
 	ret[len] = 0;
 	return memcpy(ret, s, len);
@@ -1,2 +1,2 @@
-SRCS_LIBK_C := $(subdir)/assert.c $(subdir)/stream.c $(subdir)/exception.c $(subdir)/slab.c $(subdir)/string.c $(subdir)/list.c $(subdir)/map.c $(subdir)/iterator.c $(subdir)/tree.c $(subdir)/vector.c $(subdir)/arena.c $(subdir)/arraymap.c $(subdir)/structures.c $(subdir)/destructor.c
+SRCS_LIBK_C := $(subdir)/assert.c $(subdir)/stream.c $(subdir)/exception.c $(subdir)/slab.c $(subdir)/string.c $(subdir)/lz.c $(subdir)/list.c $(subdir)/map.c $(subdir)/iterator.c $(subdir)/tree.c $(subdir)/vector.c $(subdir)/arena.c $(subdir)/arraymap.c $(subdir)/structures.c $(subdir)/destructor.c
 SRCS_C += $(SRCS_LIBK_C)
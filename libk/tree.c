@@ -48,7 +48,7 @@ static void node_mark(void * p)
 	slab_gc_mark(node->right);
 }
 
-static slab_type_t nodes[1] = { SLAB_TYPE(sizeof(node_t), node_mark, 0)};
+static slab_type_t nodes[1] = { SLAB_TYPE_ALIGNED(sizeof(node_t), ARCH_CACHE_LINE, node_mark, 0)};
 static slab_type_t trees[1] = { SLAB_TYPE(sizeof(tree_t), tree_mark, 0)};
 
 /*
@@ -20,7 +20,7 @@ typedef struct vector_table_s {
 	intptr_t d[VECTOR_TABLE_ENTRIES];
 } vector_table_t;
 
-static slab_type_t vectors[1] = {SLAB_TYPE(sizeof(vector_t), 0, 0)};
+static slab_type_t vectors[1] = {SLAB_TYPE_LAYOUT(sizeof(vector_t), SLAB_PTR(vector_t, map.ops) | SLAB_PTR(vector_t, table), 0)};
 static slab_type_t tables[1] = {SLAB_TYPE(sizeof(vector_table_t), 0, 0)};
 
 void vector_init()
@@ -62,7 +62,7 @@ static intptr_t * vector_entry_get(vector_table_t * table, map_key i, int create
 static void vector_checksize(vector_t * v, map_key i)
 {
 	/* Extend the table as necessary */
-	while(1<<(VECTOR_TABLE_ENTRIES_LOG2*(v->table->level+1))<i) {
+	while(1<<(VECTOR_TABLE_ENTRIES_LOG2*(v->table->level+1))<=i) {
 		vector_table_t * table = vector_table_new(v->table->level+1);
 		table->d[0] = (intptr_t)v->table;
 		v->table = table;